@@ -21,6 +21,10 @@
 
 #include <limits.h>
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 /* used for binary mode piped i/o on Windows */
 #ifdef _WIN32
 #include <fcntl.h>
@@ -28,6 +32,7 @@
 #endif
 
 #include "bswap.h"
+#include "ring.h"
 #include "wav.h"
 #include "flake.h"
 
@@ -35,6 +40,16 @@
 #define PATH_MAX 255
 #endif
 
+/* serializes multi-line console output when encoding files concurrently */
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t console_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define console_lock()   pthread_mutex_lock(&console_mutex)
+#define console_unlock() pthread_mutex_unlock(&console_mutex)
+#else
+#define console_lock()
+#define console_unlock()
+#endif
+
 static void
 print_usage(FILE *out)
 {
@@ -48,6 +63,9 @@ print_help(FILE *out)
     fprintf(out, "usage: flake [options] <input.wav> [-o output.flac]\n"
                  "options:\n"
                  "       [-h]         Print out list of commandline options\n"
+                 "       [-c #]       Split each file into # parts which are encoded\n"
+                 "                    concurrently, then joined (default: 1)\n"
+                 "       [-j #]       Number of files to encode concurrently (default: 1)\n"
                  "       [-q]         Quiet mode\n"
                  "       [-p #]       Padding bytes to put in header (default: 4096)\n"
                  "       [-0 ... -12] Compression level (default: 5)\n"
@@ -86,6 +104,19 @@ print_help(FILE *out)
                  "                        0 = fixed (default)\n"
                  "                        1 = variable, method 1\n"
                  "                        2 = variable, method 2\n"
+                 "       [-n #]       Number of encoding threads [1 - 64] (default: 1)\n"
+                 "       [-x #]       Also use threads within each frame (sum of)\n"
+                 "                        0 = frames only (default)\n"
+                 "                        1 = channels\n"
+                 "                        2 = prediction order search\n"
+                 "                        4 = variable block size trials\n"
+                 "                        8 = MD5 checksum (also with -n 1)\n"
+                 "       [-a #]       Pin encoding threads to CPUs\n"
+                 "                        0 = no (default)\n"
+                 "                        1 = yes, in turn over the CPUs the process\n"
+                 "                            may use (see taskset)\n"
+                 "       [-u #]       CPU budget in percent of one CPU; effort is\n"
+                 "                    lowered to stay within it (default: 0 = none)\n"
                  "\n");
 }
 
@@ -94,6 +125,9 @@ typedef struct FilePair {
     char *outfile;
     FILE *ifp;
     FILE *ofp;
+    int done;
+    uint64_t wav_bytes;
+    uint64_t flac_bytes;
 } FilePair;
 
 typedef struct CommandOptions {
@@ -111,7 +145,14 @@ typedef struct CommandOptions {
     int stmethod;
     int padding;
     int vbs;
+    int threads;
+    int thread_flags;
+    int affinity;
+    int cpu_budget;
+    int jobs;
+    int shards;
     int quiet;
+    FlakePool *pool;
 } CommandOptions;
 
 static int
@@ -142,7 +183,7 @@ static int
 parse_commandline(int argc, char **argv, CommandOptions *opts)
 {
     int i;
-    static const char *param_str = "bhlmopqrstv";
+    static const char *param_str = "abchjlmnopqrstuvx";
     int max_digits = 8;
     int ifc = 0;
 
@@ -165,6 +206,12 @@ parse_commandline(int argc, char **argv, CommandOptions *opts)
     opts->stmethod = -1;
     opts->padding = -1;
     opts->vbs = -1;
+    opts->threads = -1;
+    opts->thread_flags = -1;
+    opts->affinity = -1;
+    opts->cpu_budget = -1;
+    opts->jobs = 1;
+    opts->shards = 1;
     opts->quiet = 0;
 
     for(i=1; i<argc; i++) {
@@ -201,10 +248,22 @@ parse_commandline(int argc, char **argv, CommandOptions *opts)
                 }
 
                 switch(argv[i-1][1]) {
+                    case 'a':
+                        opts->affinity = parse_number(argv[i], max_digits);
+                        if(opts->affinity < 0) return 1;
+                        break;
                     case 'b':
                         opts->bsize = parse_number(argv[i], max_digits);
                         if(opts->bsize < 0) return 1;
                         break;
+                    case 'c':
+                        opts->shards = parse_number(argv[i], max_digits);
+                        if(opts->shards < 1 || opts->shards > 64) return 1;
+                        break;
+                    case 'j':
+                        opts->jobs = parse_number(argv[i], max_digits);
+                        if(opts->jobs < 1) return 1;
+                        break;
                     case 'l':
                         if(strchr(argv[i], ',') == NULL) {
                             opts->omin = 0;
@@ -229,6 +288,10 @@ parse_commandline(int argc, char **argv, CommandOptions *opts)
                         opts->omethod = parse_number(argv[i], max_digits);
                         if(opts->omethod < 0) return 1;
                         break;
+                    case 'n':
+                        opts->threads = parse_number(argv[i], max_digits);
+                        if(opts->threads < 0) return 1;
+                        break;
                     case 'o':
                         if(opts->found_output) {
                             return 1;
@@ -269,10 +332,18 @@ parse_commandline(int argc, char **argv, CommandOptions *opts)
                         opts->ptype = parse_number(argv[i], max_digits);
                         if(opts->ptype < 0) return 1;
                         break;
+                    case 'u':
+                        opts->cpu_budget = parse_number(argv[i], max_digits);
+                        if(opts->cpu_budget < 0) return 1;
+                        break;
                     case 'v':
                         opts->vbs = parse_number(argv[i], max_digits);
                         if(opts->vbs < 0) return 1;
                         break;
+                    case 'x':
+                        opts->thread_flags = parse_number(argv[i], max_digits);
+                        if(opts->thread_flags < 0) return 1;
+                        break;
                 }
             }
         } else {
@@ -365,18 +436,490 @@ print_params(FlakeContext *s)
         fprintf(stderr, "stereo method: %s\n", stmethod_s);
     }
     fprintf(stderr, "header padding: %d\n", s->params.padding_size);
+    if(s->params.threads > 1) {
+        fprintf(stderr, "threads: %d", s->params.threads);
+        if(s->params.thread_flags & FLAKE_THREAD_CHANNELS) {
+            fprintf(stderr, " (channels)");
+        }
+        if(s->params.thread_flags & FLAKE_THREAD_ORDERS) {
+            fprintf(stderr, " (orders)");
+        }
+        if(s->params.thread_flags & FLAKE_THREAD_VBS) {
+            fprintf(stderr, " (vbs trials)");
+        }
+        if(s->params.pool != NULL) {
+            fprintf(stderr, " (shared by all files)");
+        }
+        if(s->params.affinity) {
+            fprintf(stderr, " (pinned)");
+        }
+        fprintf(stderr, "\n");
+    }
+    if(s->params.thread_flags & FLAKE_THREAD_MD5) {
+        fprintf(stderr, "md5 checksum: separate thread\n");
+    }
+    if(s->params.cpu_budget > 0) {
+        fprintf(stderr, "cpu budget: %d%%\n", s->params.cpu_budget);
+    }
+}
+
+/* number of buffered input blocks and output frames in the I/O pipeline */
+#define PIPE_SLOTS 4
+
+/**
+ * Input and output of one file.  If threads are available, reading and
+ * writing are done by separate threads connected to the encoder by buffer
+ * rings, so that disk or pipe stalls overlap with encoding.  Otherwise the
+ * encoder thread does its own I/O.
+ */
+typedef struct FileStream {
+    WavFile *wf;
+    FILE *ofp;
+    int block_size;
+    int16_t *wav;
+    uint8_t *frame;
+#ifdef HAVE_PTHREADS
+    int threaded;
+    Ring *in, *out;
+    pthread_t reader, writer;
+#endif
+} FileStream;
+
+#ifdef HAVE_PTHREADS
+static void *
+reader_thread(void *arg)
+{
+    FileStream *st = arg;
+    int16_t *wav;
+    int nr;
+
+    // a block of 0 or fewer samples marks the end of the input
+    do {
+        wav = ring_write_begin(st->in);
+        nr = wavfile_read_samples(st->wf, wav, st->block_size);
+        ring_write_end(st->in, nr);
+    } while(nr > 0);
+    return NULL;
+}
+
+static void *
+writer_thread(void *arg)
+{
+    FileStream *st = arg;
+    uint8_t *frame;
+    int fs;
+
+    // a frame size of 0 marks the end of the output
+    for(;;) {
+        frame = ring_read_begin(st->out, &fs);
+        if(fs <= 0) break;
+        fwrite(frame, 1, fs, st->ofp);
+        ring_read_end(st->out);
+    }
+    return NULL;
+}
+#endif
+
+static int
+stream_open(FileStream *st, WavFile *wf, FILE *ofp, int block_size,
+            int max_frame_size)
+{
+    int wav_size = block_size * wf->channels * sizeof(int16_t);
+
+    st->wf = wf;
+    st->ofp = ofp;
+    st->block_size = block_size;
+
+#ifdef HAVE_PTHREADS
+    st->threaded = 0;
+    st->in = ring_create(PIPE_SLOTS, wav_size);
+    st->out = ring_create(PIPE_SLOTS, max_frame_size);
+    if(st->in != NULL && st->out != NULL &&
+       !pthread_create(&st->writer, NULL, writer_thread, st)) {
+        if(!pthread_create(&st->reader, NULL, reader_thread, st)) {
+            st->threaded = 1;
+            return 0;
+        }
+        // stop the writer and fall back to doing I/O on this thread
+        ring_write_begin(st->out);
+        ring_write_end(st->out, 0);
+        pthread_join(st->writer, NULL);
+    }
+    ring_destroy(st->in);
+    ring_destroy(st->out);
+    st->in = st->out = NULL;
+#endif
+
+    st->wav = malloc(wav_size);
+    st->frame = malloc(max_frame_size);
+    if(st->wav == NULL || st->frame == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Get the next block of input samples.  The buffer stays valid until
+ * stream_read_done() is called.
+ * @param nr  number of samples read; 0 or less at the end of the input
+ */
+static int16_t *
+stream_read(FileStream *st, int *nr)
+{
+#ifdef HAVE_PTHREADS
+    if(st->threaded) {
+        return ring_read_begin(st->in, nr);
+    }
+#endif
+    *nr = wavfile_read_samples(st->wf, st->wav, st->block_size);
+    return st->wav;
+}
+
+static void
+stream_read_done(FileStream *st)
+{
+#ifdef HAVE_PTHREADS
+    if(st->threaded) {
+        ring_read_end(st->in);
+    }
+#endif
+}
+
+/**
+ * Get a buffer to encode the next frame into.
+ */
+static uint8_t *
+stream_frame(FileStream *st)
+{
+#ifdef HAVE_PTHREADS
+    if(st->threaded) {
+        return ring_write_begin(st->out);
+    }
+#endif
+    return st->frame;
+}
+
+/**
+ * Write the frame in the buffer returned by stream_frame().
+ */
+static void
+stream_write(FileStream *st, int fs)
+{
+#ifdef HAVE_PTHREADS
+    if(st->threaded) {
+        ring_write_end(st->out, fs);
+        return;
+    }
+#endif
+    fwrite(st->frame, 1, fs, st->ofp);
+}
+
+/**
+ * Wait for all frames to be written and free the stream buffers.  Must only
+ * be called after the end of the input has been read.
+ */
+static void
+stream_close(FileStream *st)
+{
+#ifdef HAVE_PTHREADS
+    if(st->threaded) {
+        ring_write_begin(st->out);
+        ring_write_end(st->out, 0);
+        pthread_join(st->writer, NULL);
+        pthread_join(st->reader, NULL);
+        ring_destroy(st->in);
+        ring_destroy(st->out);
+        return;
+    }
+#endif
+    if(st->wav) free(st->wav);
+    if(st->frame) free(st->frame);
+}
+
+#ifdef HAVE_PTHREADS
+/**
+ * One contiguous range of the input samples.  Each shard is encoded by its
+ * own thread, with its own input file handle and encoder context, into a
+ * temporary file.  The frame sizes are kept so that the frames can be
+ * renumbered when the shards are joined.
+ */
+typedef struct Shard {
+    const char *infile;
+    FlakeContext s;
+    uint32_t start;
+    uint32_t length;
+    FILE *tmp;
+    int *frame_sizes;
+    int frame_count;
+    int err;
+    pthread_t thread;
+} Shard;
+
+static int
+shard_add_frame(Shard *sh, int fs)
+{
+    if((sh->frame_count & 255) == 0) {
+        int *tmp = realloc(sh->frame_sizes,
+                           (sh->frame_count + 256) * sizeof(int));
+        if(tmp == NULL) return -1;
+        sh->frame_sizes = tmp;
+    }
+    sh->frame_sizes[sh->frame_count++] = fs;
+    return 0;
 }
 
+/**
+ * Encode the samples of one shard, writing the frames to its temporary file.
+ */
+static int
+shard_encode(Shard *sh, WavFile *wf, int16_t *wav, uint8_t *frame)
+{
+    FlakeContext *s = &sh->s;
+    uint32_t left;
+    int block_size, nr, fs, err;
+
+    block_size = s->params.block_size;
+    left = sh->length;
+    nr = 0;
+    for(;;) {
+        if(nr == 0 && left > 0) {
+            nr = wavfile_read_samples(wf, wav, MIN(block_size, left));
+            if(nr <= 0) return -1;
+            left -= nr;
+        }
+        if(nr > 0) {
+            s->params.block_size = nr;
+            err = flake_encode_submit(s, wav);
+            if(err < 0) return -1;
+            if(err == 0) {
+                nr = 0;
+                continue;
+            }
+        }
+        fs = flake_encode_collect(s, frame, NULL);
+        if(fs == 0) break;
+        if(fs < 0 || shard_add_frame(sh, fs)) return -1;
+        if(fwrite(frame, 1, fs, sh->tmp) != (size_t)fs) return -1;
+    }
+    return 0;
+}
+
+static void *
+shard_thread(void *arg)
+{
+    Shard *sh = arg;
+    FlakeContext *s = &sh->s;
+    WavFile wf;
+    FILE *ifp;
+    int16_t *wav;
+    uint8_t *frame;
+
+    sh->err = 1;
+    ifp = fopen(sh->infile, "rb");
+    if(ifp == NULL) return NULL;
+    if(wavfile_init(&wf, ifp)) {
+        fclose(ifp);
+        return NULL;
+    }
+    wf.read_format = WAV_SAMPLE_FMT_S16;
+
+    s->samples = sh->length;
+    wav = malloc(s->params.block_size * wf.channels * sizeof(int16_t));
+    sh->tmp = tmpfile();
+    if(wav != NULL && sh->tmp != NULL &&
+       !wavfile_seek_samples(&wf, sh->start, WAV_SEEK_SET) &&
+       flake_encode_init(s) >= 0) {
+        frame = malloc(s->max_frame_size);
+        if(frame != NULL) {
+            sh->err = shard_encode(sh, &wf, wav, frame);
+            free(frame);
+        }
+    }
+    flake_encode_close(s);
+    free(wav);
+    fclose(ifp);
+    return NULL;
+}
+
+typedef struct ShardMD5 {
+    const char *infile;
+    uint8_t digest[16];
+    int err;
+    pthread_t thread;
+} ShardMD5;
+
+/**
+ * The MD5 checksum covers the whole stream, so it cannot be assembled from
+ * the shards.  Instead the input is read through once more, sequentially,
+ * while the shards are being encoded.
+ */
+static void *
+shard_md5_thread(void *arg)
+{
+    ShardMD5 *m = arg;
+    FlakeMD5 *md5;
+    WavFile wf;
+    FILE *ifp;
+    int16_t *wav;
+    int nr;
+
+    m->err = 1;
+    ifp = fopen(m->infile, "rb");
+    if(ifp == NULL) return NULL;
+    if(wavfile_init(&wf, ifp)) {
+        fclose(ifp);
+        return NULL;
+    }
+    wf.read_format = WAV_SAMPLE_FMT_S16;
+
+    wav = malloc(4096 * wf.channels * sizeof(int16_t));
+    md5 = flake_md5_create();
+    if(wav != NULL && md5 != NULL) {
+        while((nr = wavfile_read_samples(&wf, wav, 4096)) > 0) {
+            flake_md5_update(md5, wav, wf.channels, nr);
+        }
+        m->err = (nr < 0);
+    }
+    if(md5 != NULL) flake_md5_close(md5, m->digest);
+    free(wav);
+    fclose(ifp);
+    return NULL;
+}
+
+/**
+ * Encode a seekable input file as a number of shards in parallel, then join
+ * the shards into the output.  Shard lengths are a multiple of the block
+ * size, so the joined stream is the same as a sequential encode apart from
+ * the frame numbers, which are rewritten, and the minimum and maximum frame
+ * sizes in the header, which are filled in.
+ * @param s  initialized encoder context whose parameters are used by all shards
+ */
+static int
+encode_shards(FilePair *files, FlakeContext *s,
+              WavFile *wf, int nshards, uint32_t *samplecount,
+              uint32_t *bytecount, uint8_t *md5digest)
+{
+    Shard *shards;
+    ShardMD5 m;
+    FlakePool *pool = NULL;
+    uint8_t *frame, *out;
+    uint32_t per_shard, frame_num;
+    int i, j, fs, min_fs, max_fs, err;
+
+    // all shards share one pool of frame threads
+    per_shard = (wf->samples + nshards - 1) / nshards;
+    per_shard = (per_shard + s->params.block_size - 1) / s->params.block_size;
+    per_shard *= s->params.block_size;
+    nshards = (wf->samples + per_shard - 1) / per_shard;
+    if(s->params.threads > 1 && s->params.pool == NULL) {
+        if(s->params.affinity) {
+            pool = flake_pool_create_pinned(s->params.threads);
+        } else {
+            pool = flake_pool_create(s->params.threads);
+        }
+    }
+
+    shards = calloc(nshards, sizeof(Shard));
+    frame = malloc(s->max_frame_size);
+    out = malloc(s->max_frame_size + 6);
+    if(shards == NULL || frame == NULL || out == NULL) {
+        free(shards);
+        free(frame);
+        free(out);
+        flake_pool_destroy(pool);
+        return 1;
+    }
+
+    m.infile = files->infile;
+    if(pthread_create(&m.thread, NULL, shard_md5_thread, &m)) {
+        shard_md5_thread(&m);
+        m.thread = pthread_self();
+    }
+    for(i=0; i<nshards; i++) {
+        Shard *sh = &shards[i];
+        sh->infile = files->infile;
+        sh->s.channels = s->channels;
+        sh->s.sample_rate = s->sample_rate;
+        sh->s.bits_per_sample = s->bits_per_sample;
+        sh->s.params = s->params;
+        if(pool != NULL) sh->s.params.pool = pool;
+        // the per-shard checksums are not used
+        sh->s.params.thread_flags &= ~FLAKE_THREAD_MD5;
+        sh->start = i * per_shard;
+        sh->length = MIN(per_shard, wf->samples - sh->start);
+        // if a thread cannot be started, encode the shard here instead
+        if(pthread_create(&sh->thread, NULL, shard_thread, sh)) {
+            shard_thread(sh);
+            sh->thread = pthread_self();
+        }
+    }
+
+    // join the shards in order, renumbering the frames
+    err = 0;
+    frame_num = 0;
+    min_fs = max_fs = 0;
+    for(i=0; i<nshards; i++) {
+        Shard *sh = &shards[i];
+        if(!pthread_equal(sh->thread, pthread_self())) {
+            pthread_join(sh->thread, NULL);
+        }
+        if(sh->err) err = 1;
+        if(!err) rewind(sh->tmp);
+        for(j=0; !err && j<sh->frame_count; j++) {
+            if(fread(frame, 1, sh->frame_sizes[j], sh->tmp) !=
+               (size_t)sh->frame_sizes[j]) {
+                err = 1;
+                break;
+            }
+            fs = flake_frame_renumber(frame, sh->frame_sizes[j], frame_num++,
+                                      out);
+            if(fs < 0) {
+                err = 1;
+                break;
+            }
+            fwrite(out, 1, fs, files->ofp);
+            if(min_fs == 0 || fs < min_fs) min_fs = fs;
+            if(fs > max_fs) max_fs = fs;
+            *bytecount += fs;
+        }
+        if(!err) *samplecount += sh->length;
+        if(sh->tmp != NULL) fclose(sh->tmp);
+        free(sh->frame_sizes);
+    }
+    if(!pthread_equal(m.thread, pthread_self())) {
+        pthread_join(m.thread, NULL);
+    }
+    if(m.err) err = 1;
+    memcpy(md5digest, m.digest, 16);
+
+    // if seeking is possible, rewrite the minimum and maximum frame size
+    if(!err && !fseek(files->ofp, 12, SEEK_SET)) {
+        uint8_t fsizes[6] = { min_fs >> 16, min_fs >> 8, min_fs,
+                              max_fs >> 16, max_fs >> 8, max_fs };
+        fwrite(fsizes, 1, 6, files->ofp);
+    }
+
+    free(shards);
+    free(frame);
+    free(out);
+    flake_pool_destroy(pool);
+    return err;
+}
+#endif
+
 static int
 encode_file(CommandOptions *opts, FilePair *files, int first_file)
 {
     FlakeContext s;
     WavFile wf;
-    int header_size, subset, bs_zero;
+    FileStream st;
+    int header_size, subset, bs_zero, batch, shards;
+    int threads, thread_flags;
     uint8_t *frame;
     int16_t *wav;
-    int percent;
-    uint32_t nr, fs, samplecount, bytecount;
+    int percent, err, bs, nr, fs;
+    uint32_t samplecount, bytecount;
+    uint8_t md5digest[16] = { 0 };
     int t0, t1;
     float kb, sec, kbps, wav_bytes;
 
@@ -407,6 +950,11 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
     if(opts->pomax    >= 0) s.params.max_partition_order  = opts->pomax;
     if(opts->padding  >= 0) s.params.padding_size         = opts->padding;
     if(opts->vbs      >= 0) s.params.variable_block_size  = opts->vbs;
+    if(opts->threads  >= 0) s.params.threads              = opts->threads;
+    if(opts->thread_flags >= 0) s.params.thread_flags     = opts->thread_flags;
+    if(opts->affinity >= 0) s.params.affinity             = opts->affinity;
+    if(opts->cpu_budget >= 0) s.params.cpu_budget         = opts->cpu_budget;
+    s.params.pool = opts->pool;
 
     subset = flake_validate_params(&s);
     if(subset < 0) {
@@ -414,9 +962,31 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
         return 1;
     }
     bs_zero = (s.params.block_size == 0);
+    // sharding needs random access to the input.  variable block size is
+    // excluded because its frames cannot be split apart after collection.
+    shards = 1;
+#ifdef HAVE_PTHREADS
+    if(opts->shards > 1 && wf.seekable && wf.samples > 0 &&
+       strncmp(files->infile, "-", 2) && !s.params.variable_block_size) {
+        shards = opts->shards;
+    }
+#endif
+    // when encoding files concurrently, per-file details and progress are
+    // replaced by a single line written after each file is finished
+    batch = (opts->jobs > 1);
 
-    // initialize encoder
+    // initialize encoder.  when sharding, this context only writes the
+    // header, so it is set up without threads of its own.  the shards get
+    // the requested threads through its parameters.
+    threads = s.params.threads;
+    thread_flags = s.params.thread_flags;
+    if(shards > 1) {
+        s.params.threads = 1;
+        s.params.thread_flags = 0;
+    }
     header_size = flake_encode_init(&s);
+    s.params.threads = threads;
+    s.params.thread_flags = thread_flags;
     if(header_size < 0) {
         flake_encode_close(&s);
         fprintf(stderr, "Error initializing encoder.\n");
@@ -426,6 +996,7 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
 
     // print encoding parameters
     if(first_file && !opts->quiet) {
+        console_lock();
         if(subset == 1) {
             fprintf(stderr,"=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=\n"
                            " WARNING! The chosen encoding options are\n"
@@ -440,9 +1011,15 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
             fprintf(stderr, "block size: %d\n", s.params.block_size);
         }
         print_params(&s);
+        if(batch) fprintf(stderr, "\n");
+        console_unlock();
     }
 
-    if(!opts->quiet) {
+    if(!opts->quiet && batch && wf.bit_width != 16) {
+        fprintf(stderr, "WARNING! \"%s\": converting to 16-bit (not lossless)\n",
+                files->infile);
+    }
+    if(!opts->quiet && !batch) {
         fprintf(stderr, "\n");
         fprintf(stderr, "input file:  \"%s\"\n", files->infile);
         fprintf(stderr, "output file: \"%s\"\n", files->outfile);
@@ -470,49 +1047,106 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
         if(bs_zero) {
             fprintf(stderr, "block size: %d\n", s.params.block_size);
         }
+        if(shards > 1) {
+            fprintf(stderr, "encoding in %d parts\n", shards);
+        }
     }
 
-    frame = malloc(s.max_frame_size);
-    wav = malloc(s.params.block_size * wf.channels * sizeof(int16_t));
-
     samplecount = t0 = percent = 0;
     wav_bytes = 0;
     bytecount = header_size;
-    nr = wavfile_read_samples(&wf, wav, s.params.block_size);
-    while(nr > 0) {
-        s.params.block_size = nr;
-        fs = flake_encode_frame(&s, frame, wav);
-        if(fs < 0) {
-            fprintf(stderr, "Error encoding frame\n");
-        } else if(fs > 0) {
-            fwrite(frame, 1, fs, files->ofp);
-            samplecount += s.params.block_size;
-            bytecount += fs;
-            t1 = samplecount / s.sample_rate;
-            if(t1 > t0) {
-                kb = ((bytecount * 8.0) / 1000.0);
-                sec = ((float)samplecount) / ((float)s.sample_rate);
-                if(samplecount > 0) kbps = kb / sec;
-                else kbps = kb;
-                if(s.samples > 0) {
-                    percent = ((samplecount * 100.5) / s.samples);
+#ifdef HAVE_PTHREADS
+    if(shards > 1) {
+        if(encode_shards(files, &s, &wf, shards, &samplecount, &bytecount,
+                         md5digest)) {
+            flake_encode_close(&s);
+            fprintf(stderr, "Error encoding file\n");
+            return 1;
+        }
+        wav_bytes = samplecount*wf.block_align;
+        if(!opts->quiet && !batch) {
+            fprintf(stderr, "ratio: %1.3f ", (bytecount / wav_bytes));
+        }
+    } else
+#endif
+    {
+        memset(&st, 0, sizeof(FileStream));
+        if(stream_open(&st, &wf, files->ofp, s.params.block_size,
+                       s.max_frame_size)) {
+            stream_close(&st);
+            flake_encode_close(&s);
+            fprintf(stderr, "Error allocating buffers.\n");
+            return 1;
+        }
+
+        wav = stream_read(&st, &nr);
+        for(;;) {
+            // queue blocks until the encoder is busy, then write out the
+            // oldest finished frame
+            if(nr > 0) {
+                s.params.block_size = nr;
+                err = flake_encode_submit(&s, wav);
+                if(err < 0) {
+                    fprintf(stderr, "Error encoding frame\n");
                 }
-                wav_bytes = samplecount*wf.block_align;
-                if(!opts->quiet) {
-                    fprintf(stderr, "\rprogress: %3d%% | ratio: %1.3f | "
-                                    "bitrate: %4.1f kbps ",
-                            percent, (bytecount / wav_bytes), kbps);
+                if(err <= 0) {
+                    stream_read_done(&st);
+                    wav = stream_read(&st, &nr);
+                    continue;
+                }
+            }
+            frame = stream_frame(&st);
+            fs = flake_encode_collect(&s, frame, &bs);
+            if(fs == 0) break;
+            if(fs < 0) {
+                fprintf(stderr, "Error encoding frame\n");
+            } else if(fs > 0) {
+                stream_write(&st, fs);
+                samplecount += bs;
+                bytecount += fs;
+                t1 = samplecount / s.sample_rate;
+                if(t1 > t0) {
+                    kb = ((bytecount * 8.0) / 1000.0);
+                    sec = ((float)samplecount) / ((float)s.sample_rate);
+                    if(samplecount > 0) kbps = kb / sec;
+                    else kbps = kb;
+                    if(s.samples > 0) {
+                        percent = ((samplecount * 100.5) / s.samples);
+                    }
+                    wav_bytes = samplecount*wf.block_align;
+                    if(!opts->quiet && !batch) {
+                        fprintf(stderr, "\rprogress: %3d%% | ratio: %1.3f | "
+                                        "bitrate: %4.1f kbps ",
+                                percent, (bytecount / wav_bytes), kbps);
+                    }
                 }
+                t0 = t1;
             }
-            t0 = t1;
         }
-        nr = wavfile_read_samples(&wf, wav, s.params.block_size);
+        stream_close(&st);
     }
+
     if(!opts->quiet) {
-        fprintf(stderr, "| bytes: %d \n\n", bytecount);
+        if(batch) {
+            wav_bytes = samplecount*wf.block_align;
+            console_lock();
+            fprintf(stderr, "\"%s\" | ratio: %1.3f | bytes: %d\n",
+                    files->outfile,
+                    (wav_bytes > 0) ? (bytecount / wav_bytes) : 0.0,
+                    bytecount);
+            console_unlock();
+        } else {
+            fprintf(stderr, "| bytes: %d \n\n", bytecount);
+        }
     }
+    files->done = 1;
+    files->wav_bytes = (uint64_t)samplecount * wf.block_align;
+    files->flac_bytes = bytecount;
 
     flake_encode_close(&s);
+    if(shards > 1) {
+        memcpy(s.md5digest, md5digest, 16);
+    }
 
     // if seeking is possible, rewrite sample count and MD5 checksum
     if(!fseek(files->ofp, 22, SEEK_SET)) {
@@ -521,9 +1155,6 @@ encode_file(CommandOptions *opts, FilePair *files, int first_file)
         fwrite(s.md5digest, 1, 16, files->ofp);
     }
 
-    free(wav);
-    free(frame);
-
     return 0;
 }
 
@@ -557,6 +1188,136 @@ open_files(FilePair *files)
     return 0;
 }
 
+static int
+process_file(CommandOptions *opts, int index)
+{
+    FilePair *files = &opts->filelist[index];
+    int err;
+
+    if(open_files(files)) {
+        return 1;
+    }
+    err = encode_file(opts, files, (index==0));
+    fclose(files->ofp);
+    fclose(files->ifp);
+    return err;
+}
+
+#ifdef HAVE_PTHREADS
+typedef struct BatchQueue {
+    CommandOptions *opts;
+    pthread_mutex_t lock;
+    int next_file;
+    int err;
+} BatchQueue;
+
+static void *
+batch_worker(void *arg)
+{
+    BatchQueue *q = arg;
+    int i;
+
+    for(;;) {
+        // take the next file from the list. after a failure no new files
+        // are started, as in sequential mode.
+        pthread_mutex_lock(&q->lock);
+        if(q->err || q->next_file >= q->opts->input_count) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        i = q->next_file++;
+        pthread_mutex_unlock(&q->lock);
+
+        if(process_file(q->opts, i)) {
+            pthread_mutex_lock(&q->lock);
+            q->err = 1;
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * Encode all files in the list.  With more than one job, files are handed
+ * out to a set of worker threads, each with its own encoder context.  If
+ * frame threads are also requested, all files share one pool of encoding
+ * threads, so workers which run out of frames from short files steal frames
+ * from the longer ones.
+ */
+static int
+encode_files(CommandOptions *opts)
+{
+    int i, err;
+
+#ifdef HAVE_PTHREADS
+    if(opts->jobs > 1) {
+        BatchQueue q;
+        pthread_t *threads;
+        int nthreads = 0;
+
+        if(opts->threads > 1) {
+            if(opts->affinity > 0) {
+                opts->pool = flake_pool_create_pinned(opts->threads);
+            } else {
+                opts->pool = flake_pool_create(opts->threads);
+            }
+        }
+        q.opts = opts;
+        q.next_file = 0;
+        q.err = 0;
+        pthread_mutex_init(&q.lock, NULL);
+        threads = malloc(opts->jobs * sizeof(pthread_t));
+        for(i=0; threads != NULL && i<opts->jobs; i++) {
+            if(pthread_create(&threads[nthreads], NULL, batch_worker, &q)) {
+                break;
+            }
+            nthreads++;
+        }
+        // if no threads could be started, encode on this thread
+        if(nthreads == 0) {
+            batch_worker(&q);
+        }
+        for(i=0; i<nthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+        pthread_mutex_destroy(&q.lock);
+        flake_pool_destroy(opts->pool);
+        opts->pool = NULL;
+        return q.err;
+    }
+#endif
+
+    err = 0;
+    for(i=0; i<opts->input_count; i++) {
+        err = process_file(opts, i);
+        if(err) break;
+    }
+    return err;
+}
+
+static void
+print_summary(CommandOptions *opts)
+{
+    uint64_t wav_bytes, flac_bytes;
+    int i, done;
+
+    done = 0;
+    wav_bytes = flac_bytes = 0;
+    for(i=0; i<opts->input_count; i++) {
+        if(opts->filelist[i].done) {
+            done++;
+            wav_bytes += opts->filelist[i].wav_bytes;
+            flac_bytes += opts->filelist[i].flac_bytes;
+        }
+    }
+    fprintf(stderr, "\nencoded %d of %d files | ratio: %1.3f | "
+                    "bytes: %"PRIu64"\n\n", done, opts->input_count,
+            (wav_bytes > 0) ? ((double)flac_bytes / wav_bytes) : 0.0,
+            flac_bytes);
+}
+
 static void
 filelist_cleanup(CommandOptions *opts)
 {
@@ -574,7 +1335,7 @@ int
 main(int argc, char **argv)
 {
     CommandOptions opts;
-    int i, err;
+    int err;
 
     memset(&opts, 0, sizeof(CommandOptions));
     err = parse_commandline(argc, argv, &opts);
@@ -593,15 +1354,12 @@ main(int argc, char **argv)
         return 1;
     }
 
-    for(i=0; i<opts.input_count; i++) {
-        if(open_files(&opts.filelist[i])) {
-            err = 1;
-            break;
-        }
-        err = encode_file(&opts, &opts.filelist[i], (i==0));
-        fclose(opts.filelist[i].ofp);
-        fclose(opts.filelist[i].ifp);
-        if(err) break;
+    if(opts.jobs > opts.input_count) {
+        opts.jobs = opts.input_count;
+    }
+    err = encode_files(&opts);
+    if(opts.jobs > 1 && !opts.quiet) {
+        print_summary(&opts);
     }
 
     filelist_cleanup(&opts);
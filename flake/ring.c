@@ -0,0 +1,165 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file ring.c
+ * Bounded single-producer single-consumer buffer ring
+ *
+ * The read and write positions are only ever advanced by one side each, so
+ * while the ring is neither full nor empty, both sides run without locking.
+ * A side which finds the ring full or empty sleeps on a condition variable.
+ * The other side only takes the lock to wake it if the sleeping flag is set.
+ */
+
+#include "common.h"
+
+#ifdef HAVE_PTHREADS
+
+#include <pthread.h>
+
+#include "ring.h"
+
+struct Ring {
+    uint8_t **buffers;
+    int *lengths;
+    int slots;
+    unsigned int read_pos;    // written only by the consumer
+    unsigned int write_pos;   // written only by the producer
+    int reader_sleeping;
+    int writer_sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+#define LOAD(p)      __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+Ring *
+ring_create(int slots, int slot_size)
+{
+    Ring *r;
+    int i;
+
+    r = calloc(1, sizeof(Ring));
+    if(r == NULL) return NULL;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    r->slots = slots;
+    r->buffers = calloc(slots, sizeof(uint8_t *));
+    r->lengths = calloc(slots, sizeof(int));
+    if(r->buffers == NULL || r->lengths == NULL) {
+        ring_destroy(r);
+        return NULL;
+    }
+    for(i=0; i<slots; i++) {
+        r->buffers[i] = malloc(slot_size);
+        if(r->buffers[i] == NULL) {
+            ring_destroy(r);
+            return NULL;
+        }
+    }
+    return r;
+}
+
+void
+ring_destroy(Ring *r)
+{
+    int i;
+
+    if(r == NULL) return;
+    if(r->buffers) {
+        for(i=0; i<r->slots; i++) {
+            if(r->buffers[i]) free(r->buffers[i]);
+        }
+        free(r->buffers);
+    }
+    if(r->lengths) free(r->lengths);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+/**
+ * Sleep until the other side changes its position.  The sleeping flag is set
+ * before re-checking, and each side checks the other's flag after publishing
+ * its position, so a wakeup cannot be missed.
+ */
+static void
+ring_wait(Ring *r, int *sleeping, unsigned int *pos, unsigned int old)
+{
+    pthread_mutex_lock(&r->lock);
+    STORE(sleeping, 1);
+    while(LOAD(pos) == old) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    STORE(sleeping, 0);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void
+ring_wake(Ring *r, int *sleeping)
+{
+    if(LOAD(sleeping)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+void *
+ring_write_begin(Ring *r)
+{
+    unsigned int rpos;
+
+    rpos = LOAD(&r->read_pos);
+    if(r->write_pos - rpos == (unsigned int)r->slots) {
+        ring_wait(r, &r->writer_sleeping, &r->read_pos, rpos);
+    }
+    return r->buffers[r->write_pos % r->slots];
+}
+
+void
+ring_write_end(Ring *r, int len)
+{
+    r->lengths[r->write_pos % r->slots] = len;
+    STORE(&r->write_pos, r->write_pos + 1);
+    ring_wake(r, &r->reader_sleeping);
+}
+
+void *
+ring_read_begin(Ring *r, int *len)
+{
+    unsigned int wpos;
+
+    wpos = LOAD(&r->write_pos);
+    if(wpos == r->read_pos) {
+        ring_wait(r, &r->reader_sleeping, &r->write_pos, wpos);
+    }
+    *len = r->lengths[r->read_pos % r->slots];
+    return r->buffers[r->read_pos % r->slots];
+}
+
+void
+ring_read_end(Ring *r)
+{
+    STORE(&r->read_pos, r->read_pos + 1);
+    ring_wake(r, &r->writer_sleeping);
+}
+
+#endif /* HAVE_PTHREADS */
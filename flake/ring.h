@@ -0,0 +1,62 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file ring.h
+ * Bounded single-producer single-consumer buffer ring
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include "common.h"
+
+#ifdef HAVE_PTHREADS
+
+typedef struct Ring Ring;
+
+/**
+ * Creates a ring of slots, each holding a buffer of slot_size bytes.  The
+ * buffers are allocated once and reused, so memory use stays bounded.
+ * @return NULL on error
+ */
+extern Ring *ring_create(int slots, int slot_size);
+
+extern void ring_destroy(Ring *r);
+
+/**
+ * Producer side.  Waits for a free slot and returns its buffer.  The slot is
+ * handed to the consumer by ring_write_end(), along with a length which may
+ * be used to signal the end of the stream.
+ */
+extern void *ring_write_begin(Ring *r);
+
+extern void ring_write_end(Ring *r, int len);
+
+/**
+ * Consumer side.  Waits for a filled slot and returns its buffer and length.
+ * The slot is given back to the producer by ring_read_end().
+ */
+extern void *ring_read_begin(Ring *r, int *len);
+
+extern void ring_read_end(Ring *r);
+
+#endif /* HAVE_PTHREADS */
+
+#endif /* RING_H */
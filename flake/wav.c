@@ -24,6 +24,11 @@
 
 #include "common.h"
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "flake.h"
 #include "wav.h"
 #include "bswap.h"
 
@@ -150,6 +155,9 @@ wavfile_init(WavFile *wf, FILE *fp)
         }
     }
 
+    // the FLAKE_CPU environment variable limits these as it does the encoder
+    wf->cpu_flags = flake_get_cpu_flags();
+
     wf->source_format = WAV_SAMPLE_FMT_UNKNOWN;
     wf->read_format = wf->source_format;
     if(wf->format == WAVE_FORMAT_PCM || wf->format == WAVE_FORMAT_IEEEFLOAT) {
@@ -495,110 +503,331 @@ fmt_convert(enum WavSampleFormat dest_fmt, void *dest,
     }
 }
 
-int
-wavfile_read_samples(WavFile *wf, void *output, int num_samples)
+/**
+ * Size in bytes of one sample in the given format
+ */
+static int
+fmt_size(enum WavSampleFormat fmt)
 {
-    int nr, i, j, bps, nsmp, v;
-    int convert = 1;
-    int read_size;
-    uint8_t *buffer;
+    switch(fmt) {
+        case WAV_SAMPLE_FMT_U8:  return 1;
+        case WAV_SAMPLE_FMT_S16: return 2;
+        case WAV_SAMPLE_FMT_DBL: return 8;
+        default:                 return 4;
+    }
+}
 
-    if(wf == NULL || wf->fp == NULL || output == NULL) return -1;
-    if(wf->block_align <= 0) return -1;
+/**
+ * Unpacks little-endian 3-byte samples of the given bit width
+ */
+static void
+unpack_s24_c(int32_t *dest, const uint8_t *src, int n, int bit_width)
+{
+    int i, v;
 
-    read_size = wf->block_align * num_samples;
-    if((wf->filepos + read_size) >= (wf->data_start + wf->data_size)) {
-        read_size = (wf->data_start + wf->data_size) - wf->filepos;
-        num_samples = read_size / wf->block_align;
+    for(i=0; i<n; i++, src+=3) {
+        v = src[0] + (src[1] << 8) + (src[2] << 16);
+        if(bit_width == 20) {
+            if(v >= (1<<19)) v -= (1<<20);
+        } else {
+            if(v >= (1<<23)) v -= (1<<24);
+        }
+        dest[i] = v;
     }
-    if(num_samples < 0) return -1;
-    if(num_samples == 0) return 0;
+}
 
-    convert = (wf->read_format != wf->source_format);
-    if(convert) {
-        buffer = calloc(read_size, 1);
-    } else {
-        buffer = output;
+/**
+ * Unpacks 24-bit samples straight to 16-bit.  The result is the upper 2 bytes
+ * of each sample, which is the same as unpacking and shifting right by 8.
+ */
+static void
+unpack_s24_to_s16_c(int16_t *dest, const uint8_t *src, int n)
+{
+    int i;
+
+    for(i=0; i<n; i++, src+=3) {
+        dest[i] = (int16_t)(src[1] + (src[2] << 8));
     }
+}
 
-    nr = fread(buffer, wf->block_align, num_samples, wf->fp);
-    wf->filepos += nr * wf->block_align;
-    nsmp = nr * wf->channels;
+#ifdef HAVE_X86_SIMD
+/* the SIMD versions load up to this many bytes past the samples they use */
+#define WAV_OVERREAD  16
+
+/* picks bytes 0-2 of 4 packed 3-byte samples into the top of each 32 bits */
+#define S24_SHUF  -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+
+__attribute__((target("avx2")))
+static void
+unpack_s24_avx2(int32_t *dest, const uint8_t *src, int n, int bit_width)
+{
+    int i;
+    __m256i shuf, v, half, range;
+
+    shuf = _mm256_setr_epi8(S24_SHUF, S24_SHUF);
+    half = _mm256_set1_epi32((1 << (bit_width-1)) - 1);
+    range = _mm256_set1_epi32(1 << bit_width);
+    for(i=0; i+8<=n; i+=8, src+=24) {
+        v = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)&src[12]),
+                             _mm_loadu_si128((const __m128i *)&src[0]));
+        v = _mm256_srli_epi32(_mm256_shuffle_epi8(v, shuf), 8);
+        // subtract the range from values at or above half of it, as in C
+        v = _mm256_sub_epi32(v, _mm256_and_si256(range,
+                                    _mm256_cmpgt_epi32(v, half)));
+        _mm256_storeu_si256((__m256i *)&dest[i], v);
+    }
+    unpack_s24_c(&dest[i], src, n-i, bit_width);
+}
+
+__attribute__((target("avx2")))
+static void
+unpack_s24_to_s16_avx2(int16_t *dest, const uint8_t *src, int n)
+{
+    int i;
+    __m256i shuf, v;
+
+    // the upper 2 bytes of 4 samples from each 128-bit lane
+    shuf = _mm256_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, -1, -1, -1, -1, -1, -1,
+                            -1, -1, 1, 2, 4, 5, 7, 8, 10, 11, -1, -1, -1, -1,
+                            -1, -1, -1, -1);
+    for(i=0; i+16<=n; i+=16, src+=48) {
+        v = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)&src[12]),
+                             _mm_loadu_si128((const __m128i *)&src[0]));
+        v = _mm256_shuffle_epi8(v, shuf);
+        v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)&dest[i], _mm256_castsi256_si128(v));
+        v = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)&src[36]),
+                             _mm_loadu_si128((const __m128i *)&src[24]));
+        v = _mm256_shuffle_epi8(v, shuf);
+        v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)&dest[i+8], _mm256_castsi256_si128(v));
+    }
+    unpack_s24_to_s16_c(&dest[i], src, n-i);
+}
+
+__attribute__((target("avx2")))
+static void
+s32_to_s16_avx2(int16_t *dest, const int32_t *src, int n)
+{
+    int i;
+    __m256i a, b;
+
+    for(i=0; i+16<=n; i+=16) {
+        a = _mm256_loadu_si256((const __m256i *)&src[i]);
+        b = _mm256_loadu_si256((const __m256i *)&src[i+8]);
+        a = _mm256_srai_epi32(a, 16);
+        b = _mm256_srai_epi32(b, 16);
+        // packs works within lanes, so put the 64-bit groups back in order
+        a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+                                     _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)&dest[i], a);
+    }
+    for(; i<n; i++) {
+        dest[i] = (src[i] >> 16);
+    }
+}
+
+/**
+ * The clipping matches CLIP in C, including for NaN, which becomes -32768
+ */
+__attribute__((target("avx2")))
+static void
+flt_to_s16_avx2(int16_t *dest, const float *src, int n)
+{
+    int i, v;
+    __m256 scale, lo, hi;
+    __m256i a, b;
+
+    scale = _mm256_set1_ps(32768);
+    lo = _mm256_set1_ps(-32768);
+    hi = _mm256_set1_ps(32767);
+    for(i=0; i+16<=n; i+=16) {
+        a = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(hi,
+                _mm256_mul_ps(_mm256_loadu_ps(&src[i]), scale)), lo));
+        b = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(hi,
+                _mm256_mul_ps(_mm256_loadu_ps(&src[i+8]), scale)), lo));
+        a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+                                     _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)&dest[i], a);
+    }
+    for(; i<n; i++) {
+        v = CLIP((src[i] * 32768), -32768, 32767);
+        dest[i] = v;
+    }
+}
+#else
+#define WAV_OVERREAD  0
+#endif /* HAVE_X86_SIMD */
 
-    bps = wf->block_align / wf->channels;
-    if(bps == 1) {
-        if(wf->source_format != WAV_SAMPLE_FMT_U8) return -1;
-        if(convert) {
-            fmt_convert(wf->read_format, output, wf->source_format, buffer, nsmp);
-        }
-    } else if(bps == 2) {
 #ifdef WORDS_BIGENDIAN
+static void
+swap_samples(uint8_t *buffer, int nsmp, int bps)
+{
+    int i;
+
+    if(bps == 2) {
         uint16_t *buf16 = (uint16_t *)buffer;
         for(i=0; i<nsmp; i++) {
             buf16[i] = bswap_16(buf16[i]);
         }
-#endif
-        if(wf->source_format != WAV_SAMPLE_FMT_S16) return -1;
-        if(convert) {
-            fmt_convert(wf->read_format, output, wf->source_format, (int16_t *)buffer, nsmp);
-        }
-    } else if(bps == 3) {
-        int32_t *input = calloc(nsmp, sizeof(int32_t));
-        for(i=0,j=0; i<nsmp*bps; i+=bps,j++) {
-            v = buffer[i] + (buffer[i+1] << 8) + (buffer[i+2] << 16);
-            if(wf->bit_width == 20) {
-                if(v >= (1<<19)) v -= (1<<20);
-            } else if(wf->bit_width == 24) {
-                if(v >= (1<<23)) v -= (1<<24);
-            } else {
-                fprintf(stderr, "unsupported bit width: %d\n", wf->bit_width);
-                return -1;
-            }
-            input[j] = v;
-        }
-        if(wf->source_format != WAV_SAMPLE_FMT_S20 &&
-                wf->source_format != WAV_SAMPLE_FMT_S24) {
-            return -1;
-        }
-        if(convert) {
-            fmt_convert(wf->read_format, output, wf->source_format, input, nsmp);
-        }
-        free(input);
     } else if(bps == 4) {
-#ifdef WORDS_BIGENDIAN
         uint32_t *buf32 = (uint32_t *)buffer;
         for(i=0; i<nsmp; i++) {
             buf32[i] = bswap_32(buf32[i]);
         }
+    } else if(bps == 8) {
+        uint64_t *buf64 = (uint64_t *)buffer;
+        for(i=0; i<nsmp; i++) {
+            buf64[i] = bswap_64(buf64[i]);
+        }
+    }
+}
+#endif
+
+/* raw samples which need converting are read in chunks of this many bytes */
+#define WAV_CHUNK_SIZE  12288
+
+/**
+ * Converts one chunk of raw samples into the read format
+ */
+static void
+convert_chunk(WavFile *wf, void *dest, uint8_t *buffer, int32_t *unpacked,
+              int nsmp, int bps)
+{
+#ifdef HAVE_X86_SIMD
+    int simd = (wf->cpu_flags & FLAKE_CPU_AVX2);
 #endif
-        if(wf->format == WAVE_FORMAT_IEEEFLOAT) {
-            if(wf->source_format != WAV_SAMPLE_FMT_FLT) return -1;
-            if(convert) {
-                fmt_convert(wf->read_format, output, wf->source_format, (float *)buffer, nsmp);
+
+    if(bps == 3) {
+        if(wf->read_format == WAV_SAMPLE_FMT_S16 && wf->bit_width == 24) {
+#ifdef HAVE_X86_SIMD
+            if(simd) {
+                unpack_s24_to_s16_avx2(dest, buffer, nsmp);
+                return;
             }
+#endif
+            unpack_s24_to_s16_c(dest, buffer, nsmp);
+            return;
+        }
+        // unpack in place of the output if no conversion is needed
+        if(wf->read_format == wf->source_format) {
+            unpacked = dest;
+        }
+#ifdef HAVE_X86_SIMD
+        if(simd) {
+            unpack_s24_avx2(unpacked, buffer, nsmp, wf->bit_width);
         } else {
-            if(wf->source_format != WAV_SAMPLE_FMT_S32) return -1;
-            if(convert) {
-                fmt_convert(wf->read_format, output, wf->source_format, (int32_t *)buffer, nsmp);
-            }
+            unpack_s24_c(unpacked, buffer, nsmp, wf->bit_width);
         }
-    } else if(wf->format == WAVE_FORMAT_IEEEFLOAT && bps == 8) {
-#ifdef WORDS_BIGENDIAN
-        uint64_t *buf64 = (uint64_t *)buffer;
-        for(i=0; i<nsmp; i++) {
-            buf64[i] = bswap_64(buf64[i]);
+#else
+        unpack_s24_c(unpacked, buffer, nsmp, wf->bit_width);
+#endif
+        if(unpacked != dest) {
+            fmt_convert(wf->read_format, dest, wf->source_format, unpacked,
+                        nsmp);
         }
+        return;
+    }
+
+#ifdef WORDS_BIGENDIAN
+    swap_samples(buffer, nsmp, bps);
 #endif
-        if(wf->source_format != WAV_SAMPLE_FMT_DBL) return -1;
-        if(convert) {
-            fmt_convert(wf->read_format, output, wf->source_format, (double *)buffer, nsmp);
+#ifdef HAVE_X86_SIMD
+    if(simd && wf->read_format == WAV_SAMPLE_FMT_S16) {
+        if(wf->source_format == WAV_SAMPLE_FMT_S32) {
+            s32_to_s16_avx2(dest, (int32_t *)buffer, nsmp);
+            return;
         }
+        if(wf->source_format == WAV_SAMPLE_FMT_FLT) {
+            flt_to_s16_avx2(dest, (float *)buffer, nsmp);
+            return;
+        }
+    }
+#endif
+    fmt_convert(wf->read_format, dest, wf->source_format, buffer, nsmp);
+}
+
+int
+wavfile_read_samples(WavFile *wf, void *output, int num_samples)
+{
+    int nr, n, total, bps, chunk;
+    int read_size;
+    uint8_t *dest;
+    uint8_t buffer[WAV_CHUNK_SIZE + WAV_OVERREAD];
+    int32_t unpacked[WAV_CHUNK_SIZE / 3];
+
+    if(wf == NULL || wf->fp == NULL || output == NULL) return -1;
+    if(wf->block_align <= 0) return -1;
+
+    read_size = wf->block_align * num_samples;
+    if((wf->filepos + read_size) >= (wf->data_start + wf->data_size)) {
+        read_size = (wf->data_start + wf->data_size) - wf->filepos;
+        num_samples = read_size / wf->block_align;
+    }
+    if(num_samples < 0) return -1;
+    if(num_samples == 0) return 0;
+
+    // check that the sample size matches the format
+    bps = wf->block_align / wf->channels;
+    switch(bps) {
+        case 1:
+            if(wf->source_format != WAV_SAMPLE_FMT_U8) return -1;
+            break;
+        case 2:
+            if(wf->source_format != WAV_SAMPLE_FMT_S16) return -1;
+            break;
+        case 3:
+            if(wf->source_format != WAV_SAMPLE_FMT_S20 &&
+                    wf->source_format != WAV_SAMPLE_FMT_S24) {
+                return -1;
+            }
+            if(wf->bit_width != 20 && wf->bit_width != 24) {
+                fprintf(stderr, "unsupported bit width: %d\n", wf->bit_width);
+                return -1;
+            }
+            break;
+        case 4:
+            if(wf->format == WAVE_FORMAT_IEEEFLOAT) {
+                if(wf->source_format != WAV_SAMPLE_FMT_FLT) return -1;
+            } else {
+                if(wf->source_format != WAV_SAMPLE_FMT_S32) return -1;
+            }
+            break;
+        case 8:
+            if(wf->source_format != WAV_SAMPLE_FMT_DBL) return -1;
+            break;
+        default:
+            return -1;
     }
-    if(convert) {
-        free(buffer);
+
+    // samples in the read format, other than 3-byte ones, go straight into
+    // the output
+    if(wf->read_format == wf->source_format && bps != 3) {
+        nr = fread(output, wf->block_align, num_samples, wf->fp);
+        wf->filepos += nr * wf->block_align;
+#ifdef WORDS_BIGENDIAN
+        swap_samples(output, nr * wf->channels, bps);
+#endif
+        return nr;
+    }
+
+    // otherwise each chunk is converted into the output as it is read.  a
+    // chunk must hold at least one sample of every channel.
+    if(wf->block_align > WAV_CHUNK_SIZE) return -1;
+    chunk = WAV_CHUNK_SIZE / wf->block_align;
+    dest = output;
+    total = 0;
+    while(total < num_samples) {
+        n = MIN(chunk, num_samples - total);
+        nr = fread(buffer, wf->block_align, n, wf->fp);
+        wf->filepos += nr * wf->block_align;
+        convert_chunk(wf, dest, buffer, unpacked, nr * wf->channels, bps);
+        dest += nr * wf->channels * fmt_size(wf->read_format);
+        total += nr;
+        if(nr < n) break;
     }
 
-    return nr;
+    return total;
 }
 
 int
@@ -642,6 +871,7 @@ wavfile_seek_samples(WavFile *wf, int32_t offset, int whence)
         }
     } else {
         if(fseek(wf->fp, pos, SEEK_SET)) return -1;
+        wf->filepos = pos;
     }
     return 0;
 }
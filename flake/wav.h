@@ -63,6 +63,7 @@ typedef struct WavFile {
     int bit_width;
     enum WavSampleFormat source_format; // set by wavfile_init
     enum WavSampleFormat read_format;   // set by user
+    int cpu_flags;                      // set by wavfile_init
 } WavFile;
 
 extern int wavfile_init(WavFile *wf, FILE *fp);
@@ -0,0 +1,145 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file async.c
+ * In-order delivery of frames which are encoded out of order
+ */
+
+#include "common.h"
+
+#include "async.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+struct AsyncQueue {
+    AsyncDeliver deliver;
+    void *opaque;
+    int slots;
+    int *finished;
+    int first;          // oldest reserved slot
+    int pending;        // number of reserved slots not yet delivered
+    int delivering;
+    int in_callback;    // 1 while the oldest slot is passed to deliver
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // signaled when delivery stops
+#endif
+};
+
+#ifdef HAVE_PTHREADS
+#define queue_lock(q)      pthread_mutex_lock(&(q)->lock)
+#define queue_unlock(q)    pthread_mutex_unlock(&(q)->lock)
+#else
+#define queue_lock(q)
+#define queue_unlock(q)
+#endif
+
+AsyncQueue *
+asyncqueue_create(int slots, AsyncDeliver deliver, void *opaque)
+{
+    AsyncQueue *q;
+
+    if(slots < 1 || deliver == NULL) return NULL;
+    q = calloc(1, sizeof(AsyncQueue));
+    if(q == NULL) return NULL;
+    q->finished = calloc(slots, sizeof(int));
+    if(q->finished == NULL) {
+        free(q);
+        return NULL;
+    }
+    q->deliver = deliver;
+    q->opaque = opaque;
+    q->slots = slots;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+#endif
+    return q;
+}
+
+int
+asyncqueue_reserve(AsyncQueue *q, int limit)
+{
+    int slot = -1;
+
+    queue_lock(q);
+    if(q->pending < q->slots && q->pending - q->in_callback < limit) {
+        slot = (q->first + q->pending) % q->slots;
+        q->pending++;
+    }
+    queue_unlock(q);
+    return slot;
+}
+
+void
+asyncqueue_finish(AsyncQueue *q, int slot)
+{
+    int i;
+
+    queue_lock(q);
+    q->finished[slot] = 1;
+    if(q->delivering) {
+        queue_unlock(q);
+        return;
+    }
+    q->delivering = 1;
+    while(q->pending > 0 && q->finished[q->first]) {
+        i = q->first;
+        q->in_callback = 1;
+        queue_unlock(q);
+        q->deliver(q->opaque, i);
+        queue_lock(q);
+        q->in_callback = 0;
+        q->finished[i] = 0;
+        q->first = (q->first + 1) % q->slots;
+        q->pending--;
+    }
+    q->delivering = 0;
+#ifdef HAVE_PTHREADS
+    pthread_cond_broadcast(&q->cond);
+#endif
+    queue_unlock(q);
+}
+
+void
+asyncqueue_drain(AsyncQueue *q)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&q->lock);
+    while(q->pending > 0 || q->delivering) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+#endif
+}
+
+void
+asyncqueue_destroy(AsyncQueue *q)
+{
+    if(q == NULL) return;
+#ifdef HAVE_PTHREADS
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+#endif
+    free(q->finished);
+    free(q);
+}
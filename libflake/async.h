@@ -0,0 +1,73 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file async.h
+ * In-order delivery of frames which are encoded out of order
+ */
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "common.h"
+
+typedef struct AsyncQueue AsyncQueue;
+
+/**
+ * Called with the index of each finished slot, in reservation order.  Calls
+ * for one queue never overlap.  The slot may be reserved again as soon as
+ * this returns.
+ */
+typedef void (*AsyncDeliver)(void *opaque, int slot);
+
+/**
+ * Creates a queue of slots which are reserved in turn and delivered in the
+ * same order, whatever order they finish in.
+ * @return NULL on error
+ */
+extern AsyncQueue *asyncqueue_create(int slots, AsyncDeliver deliver,
+                                     void *opaque);
+
+/**
+ * Reserves the next slot, if a slot is free and fewer than limit slots are
+ * waiting to be delivered.  A slot which is being passed to the deliver
+ * callback does not count towards the limit.
+ * @return slot index, or -1 if the queue is full
+ */
+extern int asyncqueue_reserve(AsyncQueue *q, int limit);
+
+/**
+ * Marks a slot as finished, then delivers it along with any later slots
+ * which were already finished, unless another thread is delivering.  In
+ * that case the delivering thread picks it up.  The caller must not touch
+ * the slot once this is called.
+ */
+extern void asyncqueue_finish(AsyncQueue *q, int slot);
+
+/**
+ * Waits until every reserved slot has been delivered.
+ */
+extern void asyncqueue_drain(AsyncQueue *q);
+
+/**
+ * Frees the queue.  It must be drained first.
+ */
+extern void asyncqueue_destroy(AsyncQueue *q);
+
+#endif /* ASYNC_H */
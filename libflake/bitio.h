@@ -29,12 +29,18 @@
 
 #include <assert.h>
 #include "bswap.h"
+#include "crc.h"
 
+/**
+ * Bit writer.  crc16 is the CRC-16 of all bytes stored in the buffer since
+ * bitwriter_init, kept up to date as each word or byte is stored.
+ */
 typedef struct BitWriter {
     uint32_t bit_buf;
     int bit_left;
     uint8_t *buffer, *buf_ptr, *buf_end;
     int eof;
+    uint16_t crc16;
 } BitWriter;
 
 static inline void
@@ -50,6 +56,7 @@ bitwriter_init(BitWriter *bw, void *buf, int len)
     bw->bit_left = 32;
     bw->bit_buf = 0;
     bw->eof = 0;
+    bw->crc16 = 0;
 }
 
 static inline uint32_t
@@ -70,6 +77,7 @@ bitwriter_flush(BitWriter *bw)
         }
         if(bw->buffer != NULL) {
             *bw->buf_ptr = bw->bit_buf >> 24;
+            bw->crc16 = crc16_update_byte(bw->crc16, bw->bit_buf >> 24);
         }
         bw->buf_ptr++;
         bw->bit_buf <<= 8;
@@ -103,6 +111,7 @@ bitwriter_writebits(BitWriter *bw, int bits, uint32_t val)
         }
         if(bw->buffer != NULL) {
             *(uint32_t *)bw->buf_ptr = be2me_32(bb);
+            bw->crc16 = crc16_update_word(bw->crc16, bb);
         }
         bw->buf_ptr += 4;
         bw->bit_buf = val;
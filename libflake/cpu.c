@@ -0,0 +1,142 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file cpu.c
+ * Detection of the CPU features used by optimized kernels
+ */
+
+#include "common.h"
+
+#ifdef HAVE_X86_SIMD
+#include <cpuid.h>
+#endif
+
+#include "flake.h"
+#include "cpu.h"
+
+#ifdef HAVE_X86_SIMD
+static uint32_t
+xgetbv(uint32_t index)
+{
+    uint32_t eax, edx;
+
+    // xgetbv, written as bytes for assemblers which do not know it
+    __asm__ volatile(".byte 0x0f, 0x01, 0xd0"
+                     : "=a"(eax), "=d"(edx) : "c"(index));
+    return eax;
+}
+
+static int
+detect_x86(void)
+{
+    uint32_t eax, ebx, ecx, edx, max_leaf, xcr0;
+    uint32_t ecx1, ebx7;
+    int flags = 0;
+
+    __cpuid(0, max_leaf, ebx, ecx, edx);
+    if(max_leaf < 1) return 0;
+    __cpuid(1, eax, ebx, ecx1, edx);
+    ebx7 = 0;
+    if(max_leaf >= 7) {
+        __cpuid_count(7, 0, eax, ebx7, ecx, edx);
+    }
+
+    if(ecx1 & bit_SSE4_1) {
+        flags |= FLAKE_CPU_SSE41;
+    }
+    if(ebx7 & bit_BMI2) {
+        flags |= FLAKE_CPU_BMI2;
+    }
+
+    // AVX state must also be enabled by the operating system
+    if(!(ecx1 & bit_OSXSAVE) || !(ecx1 & bit_AVX)) return flags;
+    xcr0 = xgetbv(0);
+    if((xcr0 & 0x06) != 0x06) return flags;
+    if(ebx7 & bit_AVX2) {
+        flags |= FLAKE_CPU_AVX2;
+    }
+    // opmask and upper ZMM state
+    if((xcr0 & 0xE0) == 0xE0 && (ebx7 & bit_AVX512F) &&
+       (ebx7 & bit_AVX512BW) && (ebx7 & bit_AVX512VL)) {
+        flags |= FLAKE_CPU_AVX512;
+    }
+    return flags;
+}
+#endif /* HAVE_X86_SIMD */
+
+static const struct {
+    const char *name;
+    int flags;
+} cpu_names[] = {
+    { "none",   0 },
+    { "c",      0 },
+    { "sse4.1", FLAKE_CPU_SSE41 },
+    { "avx2",   FLAKE_CPU_AVX2 },
+    { "avx512", FLAKE_CPU_AVX512 },
+    { "bmi2",   FLAKE_CPU_BMI2 },
+    { "all",    FLAKE_CPU_ALL },
+    { NULL,     0 }
+};
+
+/**
+ * Parses a list of feature names separated by commas.  Unknown names are
+ * ignored.
+ */
+static int
+parse_cpu_names(const char *str)
+{
+    int i, len;
+    int flags = 0;
+
+    while(*str) {
+        len = strcspn(str, ",");
+        for(i=0; cpu_names[i].name != NULL; i++) {
+            if(strlen(cpu_names[i].name) == (size_t)len &&
+               !strncmp(str, cpu_names[i].name, len)) {
+                flags |= cpu_names[i].flags;
+            }
+        }
+        str += len;
+        if(*str == ',') str++;
+    }
+    return flags;
+}
+
+int
+flake_get_cpu_flags(void)
+{
+    const char *env;
+    int flags = 0;
+
+#ifdef HAVE_X86_SIMD
+    flags = detect_x86();
+#endif
+    env = getenv("FLAKE_CPU");
+    if(env != NULL) {
+        flags &= parse_cpu_names(env);
+    }
+    return flags;
+}
+
+int
+cpu_select_flags(int allowed)
+{
+    return flake_get_cpu_flags() & allowed;
+}
@@ -0,0 +1,36 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file cpu.h
+ * Detection of the CPU features used by optimized kernels
+ */
+
+#ifndef CPU_H
+#define CPU_H
+
+#include "common.h"
+
+/**
+ * Returns the CPU features to use for an encoder: those returned by
+ * flake_get_cpu_flags, limited to the allowed ones.
+ */
+extern int cpu_select_flags(int allowed);
+
+#endif /* CPU_H */
@@ -22,10 +22,27 @@
 
 #include "common.h"
 
-extern void crc_init(void);
-
 extern uint8_t calc_crc8(const uint8_t *buf, uint32_t len);
 
 extern uint16_t calc_crc16(const uint8_t *buf, uint32_t len);
 
+extern const uint16_t crc16_tables[8][256];
+
+static inline uint16_t
+crc16_update_byte(uint16_t crc, uint8_t byte)
+{
+    return (crc << 8) ^ crc16_tables[0][(crc >> 8) ^ byte];
+}
+
+/**
+ * Folds 4 bytes, given as a big-endian word, into a CRC-16
+ */
+static inline uint16_t
+crc16_update_word(uint16_t crc, uint32_t word)
+{
+    word ^= (uint32_t)crc << 16;
+    return crc16_tables[3][word >> 24] ^ crc16_tables[2][(word >> 16) & 0xFF] ^
+           crc16_tables[1][(word >> 8) & 0xFF] ^ crc16_tables[0][word & 0xFF];
+}
+
 #endif /* CRC_H */
@@ -0,0 +1,45 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file dsp.c
+ * Table of the encoder's hot kernels, chosen at run time for the CPU
+ */
+
+#include "common.h"
+
+#include "dsp.h"
+
+void
+dsp_init(DSPContext *dsp, int cpu_flags)
+{
+    dsp->copy_samples = copy_samples_c;
+    dsp->calc_decorr_sums = calc_decorr_sums_c;
+    dsp->decorrelate_stereo = decorrelate_stereo_c;
+    dsp->apply_window = apply_window_c;
+    dsp->compute_autocorr = compute_autocorr_c;
+    dsp->encode_residual_lpc = encode_residual_lpc_c;
+    dsp->encode_residual_lpc_wide = encode_residual_lpc_wide_c;
+    dsp->calc_sums = calc_sums_c;
+    dsp->calc_fixed_sums = calc_fixed_sums_c;
+
+#ifdef HAVE_X86_SIMD
+    dsp_init_x86(dsp, cpu_flags);
+#endif
+}
@@ -0,0 +1,101 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file dsp.h
+ * Table of the encoder's hot kernels, chosen at run time for the CPU
+ */
+
+#ifndef DSP_H
+#define DSP_H
+
+#include "common.h"
+
+#include "rice.h"
+
+/**
+ * Every variant of a kernel must give exactly the same results as the C
+ * version, so the output never depends on the CPU.
+ */
+typedef struct DSPContext {
+    /** deinterleave n samples of each channel into separate buffers */
+    void (*copy_samples)(int32_t *dst[], const int16_t *src, int channels,
+                         int n);
+    /** sums of |2nd order residual| of left, right, mid and side */
+    void (*calc_decorr_sums)(const int32_t *left, const int32_t *right, int n,
+                             uint64_t sum[4]);
+    /** in-place stereo transform for one of the FLAC_CHMODE_* modes */
+    void (*decorrelate_stereo)(int32_t *left, int32_t *right, int n,
+                               int ch_mode);
+    /** w_data = data * window; window and w_data are 64-byte aligned */
+    void (*apply_window)(const int32_t *data, const double *window, int len,
+                         double *w_data);
+    /** autocorrelation of windowed data for lags 0 to lag; data[len] = 0 */
+    void (*compute_autocorr)(const double *data, int len, int lag,
+                             double *autoc);
+    /** LPC residual with a 32-bit prediction, for orders 1 to 32 */
+    void (*encode_residual_lpc)(int32_t *res, const int32_t *smp, int n,
+                                int order, const int32_t *coefs, int shift);
+    /** LPC residual with a 64-bit prediction */
+    void (*encode_residual_lpc_wide)(int32_t *res, const int32_t *smp, int n,
+                                     int order, const int32_t *coefs,
+                                     int shift);
+    /** Rice-maps the residual and sums partitions for orders pmin to pmax */
+    void (*calc_sums)(int pmin, int pmax, const int32_t *data, int n,
+                      int pred_order, uint32_t sums[][MAX_PARTITIONS]);
+    /**
+     * partition sums of Rice-mapped residual of fixed orders 0 to
+     * MAX_FIXED_ORDER at partition order porder
+     */
+    void (*calc_fixed_sums)(const int32_t *smp, int n, int porder,
+                            uint32_t sums[][MAX_PARTITIONS]);
+} DSPContext;
+
+/**
+ * Fills the table with the fastest kernels which use only the given
+ * features.
+ */
+extern void dsp_init(DSPContext *dsp, int cpu_flags);
+
+#ifdef HAVE_X86_SIMD
+extern void dsp_init_x86(DSPContext *dsp, int cpu_flags);
+#endif
+
+/* C versions */
+extern void copy_samples_c(int32_t *dst[], const int16_t *src, int channels,
+                           int n);
+extern void calc_decorr_sums_c(const int32_t *left, const int32_t *right,
+                               int n, uint64_t sum[4]);
+extern void decorrelate_stereo_c(int32_t *left, int32_t *right, int n,
+                                 int ch_mode);
+extern void apply_window_c(const int32_t *data, const double *window, int len,
+                           double *w_data);
+extern void compute_autocorr_c(const double *data, int len, int lag,
+                               double *autoc);
+extern void encode_residual_lpc_c(int32_t *res, const int32_t *smp, int n,
+                                  int order, const int32_t *coefs, int shift);
+extern void encode_residual_lpc_wide_c(int32_t *res, const int32_t *smp,
+                                       int n, int order, const int32_t *coefs,
+                                       int shift);
+extern void calc_sums_c(int pmin, int pmax, const int32_t *data, int n,
+                        int pred_order, uint32_t sums[][MAX_PARTITIONS]);
+extern void calc_fixed_sums_c(const int32_t *smp, int n, int porder,
+                              uint32_t sums[][MAX_PARTITIONS]);
+
+#endif /* DSP_H */
@@ -0,0 +1,721 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file dsp_x86.c
+ * x86 SIMD kernels
+ *
+ * Each function is compiled for its instruction set with a target attribute
+ * and only installed by dsp_init_x86 if the CPU has it.  The kernels must
+ * give exactly the same results as the C versions, so floating-point sums
+ * are done in the same order and without fused multiply-add.
+ */
+
+#include "common.h"
+
+#ifdef HAVE_X86_SIMD
+
+#include <immintrin.h>
+
+#include "flake.h"
+#include "dsp.h"
+#include "lpc.h"
+#include "rice.h"
+#include "encode.h"
+
+/**
+ * acc + a * b[0..3], with the product rounded before the sum as in C
+ */
+__attribute__((target("avx2")))
+static inline __m256d
+mul_add_pd(__m256d acc, __m256d a, const double *b)
+{
+    return _mm256_add_pd(acc, _mm256_mul_pd(a, _mm256_loadu_pd(b)));
+}
+
+/**
+ * Autocorrelation for the lags from l to l+7.  Within each vector the lags
+ * are in descending order, so that the samples they multiply are contiguous.
+ * Each lane adds up exactly the same products, in the same order, as
+ * compute_autocorr_c does for its lag.
+ */
+__attribute__((target("avx2")))
+static void
+autocorr_8lags_avx2(const double *data, int len, int lag, int l,
+                    double *autoc)
+{
+    int i, j;
+    double temp[8];
+    __m256d t0, t1, t2_0, t2_1, d0, d1;
+
+    for(i=0; i<8; i++) {
+        int k = l+7-i;
+        temp[i] = 1.0;
+        for(j=0; j<=lag-k; j++)
+            temp[i] += data[j+k] * data[j];
+    }
+    t0 = _mm256_loadu_pd(&temp[0]);
+    t1 = _mm256_loadu_pd(&temp[4]);
+    t2_0 = _mm256_set1_pd(1.0);
+    t2_1 = _mm256_set1_pd(1.0);
+
+    for(j=lag+1; j<=len-1; j+=2) {
+        d0 = _mm256_set1_pd(data[j]);
+        d1 = _mm256_set1_pd(data[j+1]);
+        t0   = mul_add_pd(t0,   d0, &data[j-l-7]);
+        t1   = mul_add_pd(t1,   d0, &data[j-l-3]);
+        t2_0 = mul_add_pd(t2_0, d1, &data[j-l-6]);
+        t2_1 = mul_add_pd(t2_1, d1, &data[j-l-2]);
+    }
+    _mm256_storeu_pd(&temp[0], _mm256_add_pd(t0, t2_0));
+    _mm256_storeu_pd(&temp[4], _mm256_add_pd(t1, t2_1));
+    for(i=0; i<8; i++) {
+        autoc[l+7-i] = temp[i];
+    }
+}
+
+/**
+ * Same as autocorr_8lags_avx2 for the lags from l to l+3.
+ */
+__attribute__((target("avx2")))
+static void
+autocorr_4lags_avx2(const double *data, int len, int lag, int l,
+                    double *autoc)
+{
+    int i, j;
+    double temp[4];
+    __m256d t, t2, d0, d1;
+
+    for(i=0; i<4; i++) {
+        int k = l+3-i;
+        temp[i] = 1.0;
+        for(j=0; j<=lag-k; j++)
+            temp[i] += data[j+k] * data[j];
+    }
+    t = _mm256_loadu_pd(temp);
+    t2 = _mm256_set1_pd(1.0);
+
+    for(j=lag+1; j<=len-1; j+=2) {
+        d0 = _mm256_set1_pd(data[j]);
+        d1 = _mm256_set1_pd(data[j+1]);
+        t  = mul_add_pd(t,  d0, &data[j-l-3]);
+        t2 = mul_add_pd(t2, d1, &data[j-l-2]);
+    }
+    _mm256_storeu_pd(temp, _mm256_add_pd(t, t2));
+    for(i=0; i<4; i++) {
+        autoc[l+3-i] = temp[i];
+    }
+}
+
+/**
+ * Computes 8 lags per pass over the data.  If the number of lags is not a
+ * multiple of the group size, the last group overlaps the one before it,
+ * which gives the same values for the lags computed twice.
+ */
+__attribute__((target("avx2")))
+static void
+compute_autocorr_avx2(const double *data, int len, int lag, double *autoc)
+{
+    int l;
+
+    if(lag < 3) {
+        compute_autocorr_c(data, len, lag, autoc);
+        return;
+    }
+    if(lag < 7) {
+        autocorr_4lags_avx2(data, len, lag, 0, autoc);
+        if(lag > 3) {
+            autocorr_4lags_avx2(data, len, lag, lag-3, autoc);
+        }
+        return;
+    }
+    for(l=0; l+7<=lag; l+=8) {
+        autocorr_8lags_avx2(data, len, lag, l, autoc);
+    }
+    if(l <= lag) {
+        if(lag-l < 4) {
+            autocorr_4lags_avx2(data, len, lag, lag-3, autoc);
+        } else {
+            autocorr_8lags_avx2(data, len, lag, lag-7, autoc);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+apply_window_avx2(const int32_t *data, const double *window, int len,
+                  double *w_data)
+{
+    int i;
+    __m256d d, w;
+
+    for(i=0; i+4<=len; i+=4) {
+        d = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)&data[i]));
+        w = _mm256_load_pd(&window[i]);
+        _mm256_store_pd(&w_data[i], _mm256_mul_pd(d, w));
+    }
+    for(; i<len; i++) {
+        w_data[i] = data[i] * window[i];
+    }
+}
+
+/**
+ * LPC residual, 4 samples per iteration.  Only inlined into the versions for
+ * each order below, where order is a constant, so that the loop over the
+ * coefficients is unrolled.  The 32-bit sums wrap the same way in any order,
+ * so the result equals the C version.
+ */
+__attribute__((target("sse4.1"), always_inline))
+static inline void
+lpc_residual_sse41(int32_t *res, const int32_t *smp, int n, int order,
+                   const int32_t *coefs, int shift)
+{
+    int i, j;
+    int32_t pred;
+    __m128i c[MAX_LPC_ORDER];
+    __m128i p, s, sh;
+
+    for(j=0; j<order; j++) {
+        c[j] = _mm_set1_epi32(coefs[j]);
+    }
+    sh = _mm_cvtsi32_si128(shift);
+
+    for(i=0; i<order; i++) {
+        res[i] = smp[i];
+    }
+    for(i=order; i+4<=n; i+=4) {
+        p = _mm_setzero_si128();
+        for(j=0; j<order; j++) {
+            s = _mm_loadu_si128((const __m128i *)&smp[i-j-1]);
+            p = _mm_add_epi32(p, _mm_mullo_epi32(c[j], s));
+        }
+        s = _mm_loadu_si128((const __m128i *)&smp[i]);
+        _mm_storeu_si128((__m128i *)&res[i],
+                         _mm_sub_epi32(s, _mm_sra_epi32(p, sh)));
+    }
+    for(; i<n; i++) {
+        pred = 0;
+        for(j=0; j<order; j++) {
+            pred += coefs[j] * smp[i-j-1];
+        }
+        res[i] = smp[i] - (pred >> shift);
+    }
+}
+
+/**
+ * Same as lpc_residual_sse41, 8 samples per iteration
+ */
+__attribute__((target("avx2"), always_inline))
+static inline void
+lpc_residual_avx2(int32_t *res, const int32_t *smp, int n, int order,
+                  const int32_t *coefs, int shift)
+{
+    int i, j;
+    int32_t pred;
+    __m256i c[MAX_LPC_ORDER];
+    __m256i p, s;
+    __m128i sh;
+
+    for(j=0; j<order; j++) {
+        c[j] = _mm256_set1_epi32(coefs[j]);
+    }
+    sh = _mm_cvtsi32_si128(shift);
+
+    for(i=0; i<order; i++) {
+        res[i] = smp[i];
+    }
+    for(i=order; i+8<=n; i+=8) {
+        p = _mm256_setzero_si256();
+        for(j=0; j<order; j++) {
+            s = _mm256_loadu_si256((const __m256i *)&smp[i-j-1]);
+            p = _mm256_add_epi32(p, _mm256_mullo_epi32(c[j], s));
+        }
+        s = _mm256_loadu_si256((const __m256i *)&smp[i]);
+        _mm256_storeu_si256((__m256i *)&res[i],
+                            _mm256_sub_epi32(s, _mm256_sra_epi32(p, sh)));
+    }
+    for(; i<n; i++) {
+        pred = 0;
+        for(j=0; j<order; j++) {
+            pred += coefs[j] * smp[i-j-1];
+        }
+        res[i] = smp[i] - (pred >> shift);
+    }
+}
+
+#define TARGET_sse41 "sse4.1"
+#define TARGET_avx2  "avx2"
+
+/* instantiates X for every LPC order */
+#define LPC_ORDERS(X, ext) \
+    X(ext,  1) X(ext,  2) X(ext,  3) X(ext,  4) X(ext,  5) X(ext,  6) \
+    X(ext,  7) X(ext,  8) X(ext,  9) X(ext, 10) X(ext, 11) X(ext, 12) \
+    X(ext, 13) X(ext, 14) X(ext, 15) X(ext, 16) X(ext, 17) X(ext, 18) \
+    X(ext, 19) X(ext, 20) X(ext, 21) X(ext, 22) X(ext, 23) X(ext, 24) \
+    X(ext, 25) X(ext, 26) X(ext, 27) X(ext, 28) X(ext, 29) X(ext, 30) \
+    X(ext, 31) X(ext, 32)
+
+#define LPC_RESIDUAL_FUNC(ext, N) \
+__attribute__((target(TARGET_##ext))) \
+static void \
+lpc_residual_##ext##_##N(int32_t *res, const int32_t *smp, int n, \
+                         const int32_t *coefs, int shift) \
+{ \
+    lpc_residual_##ext(res, smp, n, N, coefs, shift); \
+}
+
+#define LPC_RESIDUAL_ENTRY(ext, N) lpc_residual_##ext##_##N,
+
+typedef void (*LpcResidualFunc)(int32_t *res, const int32_t *smp, int n,
+                                const int32_t *coefs, int shift);
+
+LPC_ORDERS(LPC_RESIDUAL_FUNC, sse41)
+LPC_ORDERS(LPC_RESIDUAL_FUNC, avx2)
+
+static const LpcResidualFunc lpc_residual_sse41_tab[MAX_LPC_ORDER] = {
+    LPC_ORDERS(LPC_RESIDUAL_ENTRY, sse41)
+};
+
+static const LpcResidualFunc lpc_residual_avx2_tab[MAX_LPC_ORDER] = {
+    LPC_ORDERS(LPC_RESIDUAL_ENTRY, avx2)
+};
+
+/**
+ * Picks the version for the order once per call, rather than per sample
+ */
+static void
+encode_residual_lpc_sse41(int32_t *res, const int32_t *smp, int n, int order,
+                          const int32_t *coefs, int shift)
+{
+    lpc_residual_sse41_tab[order-1](res, smp, n, coefs, shift);
+}
+
+static void
+encode_residual_lpc_avx2(int32_t *res, const int32_t *smp, int n, int order,
+                         const int32_t *coefs, int shift)
+{
+    lpc_residual_avx2_tab[order-1](res, smp, n, coefs, shift);
+}
+
+/**
+ * LPC residual with a 64-bit prediction, 4 samples per iteration.  AVX2 has
+ * no 64-bit arithmetic shift, so it is done as a logical shift of the
+ * one's complement for negative values.
+ */
+__attribute__((target("avx2")))
+static void
+encode_residual_lpc_wide_avx2(int32_t *res, const int32_t *smp, int n,
+                              int order, const int32_t *coefs, int shift)
+{
+    int i, j;
+    int64_t pred;
+    __m256i c[MAX_LPC_ORDER];
+    __m256i p, s, m, zero, lo;
+    __m128i sh;
+
+    for(j=0; j<order; j++) {
+        c[j] = _mm256_set1_epi64x(coefs[j]);
+    }
+    sh = _mm_cvtsi32_si128(shift);
+    zero = _mm256_setzero_si256();
+    // low half of each 64-bit lane, in the low 128 bits
+    lo = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+    for(i=0; i<order; i++) {
+        res[i] = smp[i];
+    }
+    for(i=order; i+4<=n; i+=4) {
+        p = zero;
+        for(j=0; j<order; j++) {
+            s = _mm256_cvtepi32_epi64(
+                    _mm_loadu_si128((const __m128i *)&smp[i-j-1]));
+            p = _mm256_add_epi64(p, _mm256_mul_epi32(c[j], s));
+        }
+        m = _mm256_cmpgt_epi64(zero, p);
+        p = _mm256_xor_si256(_mm256_srl_epi64(_mm256_xor_si256(p, m), sh), m);
+        p = _mm256_permutevar8x32_epi32(p, lo);
+        s = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&smp[i]));
+        _mm_storeu_si128((__m128i *)&res[i],
+                         _mm256_castsi256_si128(_mm256_sub_epi32(s, p)));
+    }
+    for(; i<n; i++) {
+        pred = 0;
+        for(j=0; j<order; j++) {
+            pred += (int64_t)coefs[j] * smp[i-j-1];
+        }
+        res[i] = smp[i] - (int32_t)(pred >> shift);
+    }
+}
+
+/**
+ * Rice mapping of 8 residuals, (2 * r) ^ (r >> 31)
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+rice_map_avx2(__m256i r)
+{
+    return _mm256_xor_si256(_mm256_add_epi32(r, r), _mm256_srai_epi32(r, 31));
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t
+hsum_epi32_avx2(__m256i v)
+{
+    __m128i x;
+
+    x = _mm_add_epi32(_mm256_castsi256_si128(v),
+                      _mm256_extracti128_si256(v, 1));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(x);
+}
+
+/**
+ * Partition sums of all fixed orders in one pass, 8 samples at a time.  The
+ * order o residual is the difference of order o-1 residuals, so each order
+ * takes one subtraction.  The first partition, which holds the samples
+ * where the higher orders have no residual, is left to the C version.
+ */
+__attribute__((target("avx2")))
+static void
+calc_fixed_sums_avx2(const int32_t *smp, int n, int porder,
+                     uint32_t sums[][MAX_PARTITIONS])
+{
+    int i, o, p, parts, psize, end;
+    int32_t r[MAX_FIXED_ORDER+1];
+    __m256i s0, s1, s2, s3, s4, d1, d2, d3, d4, e1, e2, e3, f1, f2;
+    __m256i acc[MAX_FIXED_ORDER+1];
+
+    parts = (1 << porder);
+    psize = (n >> porder);
+    if(psize < 16) {
+        calc_fixed_sums_c(smp, n, porder, sums);
+        return;
+    }
+
+    // the first partition also holds the warm-up samples
+    calc_fixed_sums_c(smp, psize, 0, sums);
+
+    for(p=1; p<parts; p++) {
+        for(o=0; o<=MAX_FIXED_ORDER; o++) {
+            acc[o] = _mm256_setzero_si256();
+        }
+        i = p * psize;
+        end = i + psize;
+        for(; i+8<=end; i+=8) {
+            s0 = _mm256_loadu_si256((const __m256i *)&smp[i]);
+            s1 = _mm256_loadu_si256((const __m256i *)&smp[i-1]);
+            s2 = _mm256_loadu_si256((const __m256i *)&smp[i-2]);
+            s3 = _mm256_loadu_si256((const __m256i *)&smp[i-3]);
+            s4 = _mm256_loadu_si256((const __m256i *)&smp[i-4]);
+            d1 = _mm256_sub_epi32(s0, s1);
+            d2 = _mm256_sub_epi32(s1, s2);
+            d3 = _mm256_sub_epi32(s2, s3);
+            d4 = _mm256_sub_epi32(s3, s4);
+            e1 = _mm256_sub_epi32(d1, d2);
+            e2 = _mm256_sub_epi32(d2, d3);
+            e3 = _mm256_sub_epi32(d3, d4);
+            f1 = _mm256_sub_epi32(e1, e2);
+            f2 = _mm256_sub_epi32(e2, e3);
+            acc[0] = _mm256_add_epi32(acc[0], rice_map_avx2(s0));
+            acc[1] = _mm256_add_epi32(acc[1], rice_map_avx2(d1));
+            acc[2] = _mm256_add_epi32(acc[2], rice_map_avx2(e1));
+            acc[3] = _mm256_add_epi32(acc[3], rice_map_avx2(f1));
+            acc[4] = _mm256_add_epi32(acc[4],
+                                      rice_map_avx2(_mm256_sub_epi32(f1, f2)));
+        }
+        for(o=0; o<=MAX_FIXED_ORDER; o++) {
+            sums[o][p] = hsum_epi32_avx2(acc[o]);
+        }
+        for(; i<end; i++) {
+            r[0] = smp[i];
+            r[1] = smp[i] - smp[i-1];
+            r[2] = smp[i] - 2*smp[i-1] + smp[i-2];
+            r[3] = smp[i] - 3*smp[i-1] + 3*smp[i-2] - smp[i-3];
+            r[4] = smp[i] - 4*smp[i-1] + 6*smp[i-2] - 4*smp[i-3] + smp[i-4];
+            for(o=0; o<=MAX_FIXED_ORDER; o++) {
+                sums[o][p] += (2*r[o]) ^ (r[o]>>31);
+            }
+        }
+    }
+}
+
+/**
+ * Rice-maps the residual and sums each partition at pmax, 8 residuals at a
+ * time.  The lower partition orders are made by adding neighbouring pairs,
+ * 8 sums at a time while there are enough of them.
+ */
+__attribute__((target("avx2")))
+static void
+calc_sums_avx2(int pmin, int pmax, const int32_t *data, int n, int pred_order,
+               uint32_t sums[][MAX_PARTITIONS])
+{
+    int i, j, parts, end;
+    __m256i acc, a, b;
+
+    parts = (1 << pmax);
+    for(i=0; i<parts; i++) {
+        j = (i == 0) ? pred_order : i * (n >> pmax);
+        end = (i + 1) * (n >> pmax);
+        acc = _mm256_setzero_si256();
+        for(; j+8<=end; j+=8) {
+            a = _mm256_loadu_si256((const __m256i *)&data[j]);
+            acc = _mm256_add_epi32(acc, rice_map_avx2(a));
+        }
+        sums[pmax][i] = hsum_epi32_avx2(acc);
+        for(; j<end; j++) {
+            sums[pmax][i] += (2*data[j]) ^ (data[j]>>31);
+        }
+    }
+
+    for(i=pmax-1; i>=pmin; i--) {
+        parts = (1 << i);
+        for(j=0; j+8<=parts; j+=8) {
+            a = _mm256_loadu_si256((const __m256i *)&sums[i+1][2*j]);
+            b = _mm256_loadu_si256((const __m256i *)&sums[i+1][2*j+8]);
+            // hadd pairs within each 128-bit lane, then put lanes in order
+            a = _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b),
+                                         _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256((__m256i *)&sums[i][j], a);
+        }
+        for(; j<parts; j++) {
+            sums[i][j] = sums[i+1][2*j] + sums[i+1][2*j+1];
+        }
+    }
+}
+
+/**
+ * 2nd order fixed residual of 8 samples
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+residual2_avx2(const int32_t *x)
+{
+    __m256i x0, x1, x2;
+
+    x0 = _mm256_loadu_si256((const __m256i *)&x[0]);
+    x1 = _mm256_loadu_si256((const __m256i *)&x[-1]);
+    x2 = _mm256_loadu_si256((const __m256i *)&x[-2]);
+    return _mm256_sub_epi32(_mm256_add_epi32(x0, x2), _mm256_add_epi32(x1, x1));
+}
+
+/**
+ * Adds 8 unsigned 32-bit values to 4 64-bit sums.  The lane each value goes
+ * to does not matter, since only the total is used.
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+add_epu32_epi64(__m256i sum, __m256i v)
+{
+    __m256i zero = _mm256_setzero_si256();
+
+    sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(v, zero));
+    return _mm256_add_epi64(sum, _mm256_unpackhi_epi32(v, zero));
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+hsum_epi64_avx2(__m256i v)
+{
+    uint64_t t[4];
+
+    _mm256_storeu_si256((__m256i *)t, v);
+    return t[0] + t[1] + t[2] + t[3];
+}
+
+/**
+ * Stereo decorrelation sums for 8 samples of each channel at a time, with
+ * 64-bit sums so that any block size is safe
+ */
+__attribute__((target("avx2")))
+static void
+calc_decorr_sums_avx2(const int32_t *left_ch, const int32_t *right_ch, int n,
+                      uint64_t sum[4])
+{
+    int i, k;
+    int32_t lt, rt;
+    __m256i l, r, acc[4];
+
+    for(k=0; k<4; k++) {
+        acc[k] = _mm256_setzero_si256();
+    }
+    for(i=2; i+8<=n; i+=8) {
+        l = residual2_avx2(&left_ch[i]);
+        r = residual2_avx2(&right_ch[i]);
+        acc[0] = add_epu32_epi64(acc[0], _mm256_abs_epi32(l));
+        acc[1] = add_epu32_epi64(acc[1], _mm256_abs_epi32(r));
+        acc[2] = add_epu32_epi64(acc[2], _mm256_abs_epi32(
+                     _mm256_srai_epi32(_mm256_add_epi32(l, r), 1)));
+        acc[3] = add_epu32_epi64(acc[3], _mm256_abs_epi32(
+                     _mm256_sub_epi32(l, r)));
+    }
+    for(k=0; k<4; k++) {
+        sum[k] = hsum_epi64_avx2(acc[k]);
+    }
+    for(; i<n; i++) {
+        lt = left_ch[i] - 2*left_ch[i-1] + left_ch[i-2];
+        rt = right_ch[i] - 2*right_ch[i-1] + right_ch[i-2];
+        sum[2] += abs((lt + rt) >> 1);
+        sum[3] += abs(lt - rt);
+        sum[0] += abs(lt);
+        sum[1] += abs(rt);
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+decorrelate_stereo_avx2(int32_t *left, int32_t *right, int n, int ch_mode)
+{
+    int i;
+    __m256i l, r;
+
+    i = 0;
+    if(ch_mode == FLAC_CHMODE_MID_SIDE) {
+        for(; i+8<=n; i+=8) {
+            l = _mm256_loadu_si256((const __m256i *)&left[i]);
+            r = _mm256_loadu_si256((const __m256i *)&right[i]);
+            _mm256_storeu_si256((__m256i *)&left[i],
+                                _mm256_srai_epi32(_mm256_add_epi32(l, r), 1));
+            _mm256_storeu_si256((__m256i *)&right[i], _mm256_sub_epi32(l, r));
+        }
+    } else if(ch_mode == FLAC_CHMODE_LEFT_SIDE) {
+        for(; i+8<=n; i+=8) {
+            l = _mm256_loadu_si256((const __m256i *)&left[i]);
+            r = _mm256_loadu_si256((const __m256i *)&right[i]);
+            _mm256_storeu_si256((__m256i *)&right[i], _mm256_sub_epi32(l, r));
+        }
+    } else if(ch_mode == FLAC_CHMODE_RIGHT_SIDE) {
+        for(; i+8<=n; i+=8) {
+            l = _mm256_loadu_si256((const __m256i *)&left[i]);
+            r = _mm256_loadu_si256((const __m256i *)&right[i]);
+            _mm256_storeu_si256((__m256i *)&left[i], _mm256_sub_epi32(l, r));
+        }
+    }
+    decorrelate_stereo_c(&left[i], &right[i], n-i, ch_mode);
+}
+
+/**
+ * Transposes 8 rows of 8 32-bit values
+ */
+__attribute__((target("avx2")))
+static inline void
+transpose_8x8_epi32(__m256i r[8])
+{
+    __m256i t[8], u[8];
+    int i;
+
+    for(i=0; i<8; i+=4) {
+        t[i  ] = _mm256_unpacklo_epi32(r[i  ], r[i+1]);
+        t[i+1] = _mm256_unpackhi_epi32(r[i  ], r[i+1]);
+        t[i+2] = _mm256_unpacklo_epi32(r[i+2], r[i+3]);
+        t[i+3] = _mm256_unpackhi_epi32(r[i+2], r[i+3]);
+        u[i  ] = _mm256_unpacklo_epi64(t[i  ], t[i+2]);
+        u[i+1] = _mm256_unpackhi_epi64(t[i  ], t[i+2]);
+        u[i+2] = _mm256_unpacklo_epi64(t[i+1], t[i+3]);
+        u[i+3] = _mm256_unpackhi_epi64(t[i+1], t[i+3]);
+    }
+    for(i=0; i<4; i++) {
+        r[i  ] = _mm256_permute2x128_si256(u[i], u[i+4], 0x20);
+        r[i+4] = _mm256_permute2x128_si256(u[i], u[i+4], 0x31);
+    }
+}
+
+/**
+ * Deinterleaves 8 samples of each channel at a time.  Mono and stereo are
+ * widened and split directly.  For 6 and 8 channels, each sample's
+ * channels are widened into one row and the rows are transposed.  Other
+ * channel counts, and the samples left over, use the C version.
+ */
+__attribute__((target("avx2")))
+static void
+copy_samples_avx2(int32_t *dst[], const int16_t *src, int channels, int n)
+{
+    int i, ch;
+    __m256i v, r[8];
+    int32_t *tail[FLAC_MAX_CH];
+
+    i = 0;
+    if(channels == 1) {
+        for(; i+8<=n; i+=8) {
+            v = _mm256_cvtepi16_epi32(
+                    _mm_loadu_si128((const __m128i *)&src[i]));
+            _mm256_storeu_si256((__m256i *)&dst[0][i], v);
+        }
+    } else if(channels == 2) {
+        for(; i+8<=n; i+=8) {
+            // each 32-bit lane holds left in the low half, right in the high
+            v = _mm256_loadu_si256((const __m256i *)&src[2*i]);
+            _mm256_storeu_si256((__m256i *)&dst[0][i],
+                    _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16));
+            _mm256_storeu_si256((__m256i *)&dst[1][i],
+                                _mm256_srai_epi32(v, 16));
+        }
+    } else if(channels == 6) {
+        // each row loads 2 values past its sample, so the group must not
+        // include the last sample
+        for(; i+9<=n; i+=8) {
+            for(ch=0; ch<8; ch++) {
+                r[ch] = _mm256_cvtepi16_epi32(
+                            _mm_loadu_si128((const __m128i *)&src[6*(i+ch)]));
+            }
+            transpose_8x8_epi32(r);
+            for(ch=0; ch<6; ch++) {
+                _mm256_storeu_si256((__m256i *)&dst[ch][i], r[ch]);
+            }
+        }
+    } else if(channels == 8) {
+        for(; i+8<=n; i+=8) {
+            for(ch=0; ch<8; ch++) {
+                r[ch] = _mm256_cvtepi16_epi32(
+                            _mm_loadu_si128((const __m128i *)&src[8*(i+ch)]));
+            }
+            transpose_8x8_epi32(r);
+            for(ch=0; ch<8; ch++) {
+                _mm256_storeu_si256((__m256i *)&dst[ch][i], r[ch]);
+            }
+        }
+    }
+    if(i < n) {
+        for(ch=0; ch<channels; ch++) {
+            tail[ch] = dst[ch] + i;
+        }
+        copy_samples_c(tail, &src[i*channels], channels, n-i);
+    }
+}
+
+void
+dsp_init_x86(DSPContext *dsp, int cpu_flags)
+{
+    if(cpu_flags & FLAKE_CPU_SSE41) {
+        dsp->encode_residual_lpc = encode_residual_lpc_sse41;
+    }
+    if(cpu_flags & FLAKE_CPU_AVX2) {
+        dsp->copy_samples = copy_samples_avx2;
+        dsp->calc_decorr_sums = calc_decorr_sums_avx2;
+        dsp->decorrelate_stereo = decorrelate_stereo_avx2;
+        dsp->apply_window = apply_window_avx2;
+        dsp->compute_autocorr = compute_autocorr_avx2;
+        dsp->encode_residual_lpc = encode_residual_lpc_avx2;
+        dsp->encode_residual_lpc_wide = encode_residual_lpc_wide_avx2;
+        dsp->calc_sums = calc_sums_avx2;
+        dsp->calc_fixed_sums = calc_fixed_sums_avx2;
+    }
+}
+
+#endif /* HAVE_X86_SIMD */
@@ -22,11 +22,14 @@
 #include "encode.h"
 #include "flake.h"
 #include "bitio.h"
+#include "cpu.h"
 #include "crc.h"
+#include "hash.h"
 #include "lpc.h"
 #include "md5.h"
 #include "optimize.h"
 #include "rice.h"
+#include "thread.h"
 #include "vbs.h"
 
 
@@ -216,6 +219,13 @@ flake_set_defaults(FlakeEncodeParams *params)
     params->max_partition_order = 6;
     params->padding_size = 4096;
     params->variable_block_size = 0;
+    params->threads = 1;
+    params->thread_flags = 0;
+    params->pool = NULL;
+    params->priority = FLAKE_PRIORITY_NORMAL;
+    params->affinity = 0;
+    params->cpu_budget = 0;
+    params->cpu_flags = FLAKE_CPU_ALL;
 
     // differences from level 5
     switch(lvl) {
@@ -421,6 +431,26 @@ flake_validate_params(FlakeContext *s)
         subset = 1;
     }
 
+    if(params->threads < 0 || params->threads > FLAC_MAX_THREADS) {
+        return -1;
+    }
+    if(params->thread_flags & ~FLAKE_THREAD_ALL) {
+        return -1;
+    }
+    if(params->priority < FLAKE_PRIORITY_LOW ||
+       params->priority > FLAKE_PRIORITY_REALTIME) {
+        return -1;
+    }
+    if(params->affinity < 0 || params->affinity > 1) {
+        return -1;
+    }
+    if(params->cpu_budget < 0 || params->cpu_budget > 100*FLAC_MAX_THREADS) {
+        return -1;
+    }
+    if(params->cpu_flags & ~FLAKE_CPU_ALL) {
+        return -1;
+    }
+
     return subset;
 }
 
@@ -490,6 +520,12 @@ flake_encode_init(FlakeContext *s)
     }
 
     ctx->params = s->params;
+    // parameters filled in without flake_set_defaults may leave threads at 0
+    if(ctx->params.threads == 0) {
+        ctx->params.threads = 1;
+    }
+
+    dsp_init(&ctx->dsp, cpu_select_flags(ctx->params.cpu_flags));
 
     // select LPC precision based on block size
     if(     ctx->params.block_size <=   192) ctx->lpc_precision =  7;
@@ -520,13 +556,61 @@ flake_encode_init(FlakeContext *s)
 
     ctx->frame_count = 0;
 
-    // initialize CRC & MD5
-    crc_init();
+    // initialize MD5
     md5_init(&ctx->md5ctx);
+    ctx->md5_thread = NULL;
+    if(ctx->params.thread_flags & FLAKE_THREAD_MD5) {
+        ctx->md5_thread = hashthread_create(&ctx->md5ctx, ctx->channels,
+                                            ctx->params.block_size);
+    }
+
+    // use the shared pool if one is given, otherwise start worker threads.
+    // if threads are unavailable, queued frames are simply encoded on the
+    // calling thread.
+    ctx->pool = ctx->params.pool;
+    ctx->pool_owned = 0;
+    if(ctx->pool == NULL && ctx->params.threads > 1) {
+        ctx->pool = threadpool_create(ctx->params.threads,
+                                      ctx->params.affinity);
+        ctx->pool_owned = 1;
+    }
+    threadpool_new_group(ctx->pool, &ctx->pool_group, ctx->params.priority);
+
+    governor_init(&ctx->gov, &ctx->params, ctx->samplerate);
+    if(ctx->params.cpu_budget > 0) {
+        ctx->pool_group.cpu_time = &ctx->gov.cpu_time;
+    }
 
     return header_len;
 }
 
+/**
+ * Make sure the subframe buffers hold blocksize samples per channel.  They
+ * are allocated on first use and only grow, so a context which only encodes
+ * short blocks, such as one used for VBS trial encodes, stays small.
+ */
+static int
+alloc_frame_buffers(FlacEncodeContext *ctx, int blocksize)
+{
+    int ch;
+    int32_t *buffer;
+    FlacFrame *frame;
+
+    frame = &ctx->frame;
+    if(blocksize <= frame->buffer_size) return 0;
+
+    buffer = malloc((size_t)ctx->channels * 2 * blocksize * sizeof(int32_t));
+    if(buffer == NULL) return -1;
+    if(frame->buffer) free(frame->buffer);
+    frame->buffer = buffer;
+    frame->buffer_size = blocksize;
+    for(ch=0; ch<ctx->channels; ch++) {
+        frame->subframes[ch].samples = &buffer[(2*ch) * blocksize];
+        frame->subframes[ch].residual = &buffer[(2*ch+1) * blocksize];
+    }
+    return 0;
+}
+
 /**
  * Initialize the current frame before encoding
  */
@@ -548,6 +632,10 @@ init_frame(FlacEncodeContext *ctx)
        ctx->params.block_size > FLAC_MAX_BLOCKSIZE) {
         return -1;
     }
+    if(alloc_frame_buffers(ctx, ctx->params.block_size) ||
+       alloc_order_residual(ctx, ctx->params.block_size)) {
+        return -1;
+    }
 
     // set maximum encoded frame size (if larger, re-encodes in verbatim mode)
     if(ctx->channels == 2) {
@@ -588,12 +676,32 @@ init_frame(FlacEncodeContext *ctx)
 }
 
 /**
- * Copy channel-interleaved input samples into separate subframes
+ * Add input samples to the running MD5 checksum
  */
 static void
-update_md5_checksum(FlacEncodeContext *ctx, int16_t *samples)
+update_md5_checksum(FlacEncodeContext *ctx, int16_t *samples, int block_size)
 {
-    md5_accumulate(&ctx->md5ctx, samples, ctx->channels, ctx->params.block_size);
+    if(ctx->md5_thread != NULL) {
+        if(!hashthread_push(ctx->md5_thread, samples, block_size)) {
+            return;
+        }
+        // hash everything queued so far, then continue on this thread
+        hashthread_finish(ctx->md5_thread);
+        ctx->md5_thread = NULL;
+    }
+    md5_accumulate(&ctx->md5ctx, samples, ctx->channels, block_size);
+}
+
+void
+copy_samples_c(int32_t *dst[], const int16_t *src, int channels, int n)
+{
+    int i, j, ch;
+
+    for(i=0,j=0; i<n; i++) {
+        for(ch=0; ch<channels; ch++,j++) {
+            dst[ch][i] = src[j];
+        }
+    }
 }
 
 /**
@@ -602,30 +710,24 @@ update_md5_checksum(FlacEncodeContext *ctx, int16_t *samples)
 static void
 copy_samples(FlacEncodeContext *ctx, int16_t *samples)
 {
-    int i, j, ch;
+    int ch;
+    int32_t *dst[FLAC_MAX_CH];
     FlacFrame *frame;
 
     frame = &ctx->frame;
-    for(i=0,j=0; i<frame->blocksize; i++) {
-        for(ch=0; ch<ctx->channels; ch++,j++) {
-            frame->subframes[ch].samples[i] = samples[j];
-        }
+    for(ch=0; ch<ctx->channels; ch++) {
+        dst[ch] = frame->subframes[ch].samples;
     }
+    ctx->dsp.copy_samples(dst, samples, ctx->channels, frame->blocksize);
 }
 
-/**
- * Estimate the best stereo decorrelation mode
- */
-static int
-calc_decorr_scores(int32_t *left_ch, int32_t *right_ch, int n)
+void
+calc_decorr_sums_c(const int32_t *left_ch, const int32_t *right_ch, int n,
+                   uint64_t sum[4])
 {
-    int i, best;
+    int i;
     int32_t lt, rt;
-    uint64_t sum[4];
-    uint64_t score[4];
-    int k;
 
-    // calculate sum of 2nd order residual for each channel
     sum[0] = sum[1] = sum[2] = sum[3] = 0;
     for(i=2; i<n; i++) {
         lt = left_ch[i] - 2*left_ch[i-1] + left_ch[i-2];
@@ -635,6 +737,23 @@ calc_decorr_scores(int32_t *left_ch, int32_t *right_ch, int n)
         sum[0] += abs(lt);
         sum[1] += abs(rt);
     }
+}
+
+/**
+ * Estimate the best stereo decorrelation mode
+ */
+static int
+calc_decorr_scores(const DSPContext *dsp, int32_t *left_ch, int32_t *right_ch,
+                   int n)
+{
+    int i, best;
+    uint64_t sum[4];
+    uint64_t score[4];
+    int k;
+
+    // calculate sum of 2nd order residual for each channel
+    dsp->calc_decorr_sums(left_ch, right_ch, n, sum);
+
     // estimate bit counts
     for(i=0; i<4; i++) {
         k = find_optimal_rice_param(2*sum[i], n);
@@ -663,16 +782,37 @@ calc_decorr_scores(int32_t *left_ch, int32_t *right_ch, int n)
     return FLAC_CHMODE_LEFT_RIGHT;
 }
 
+void
+decorrelate_stereo_c(int32_t *left, int32_t *right, int n, int ch_mode)
+{
+    int i;
+    int32_t tmp;
+
+    if(ch_mode == FLAC_CHMODE_MID_SIDE) {
+        for(i=0; i<n; i++) {
+            tmp = left[i];
+            left[i] = (left[i] + right[i]) >> 1;
+            right[i] = tmp - right[i];
+        }
+    } else if(ch_mode == FLAC_CHMODE_LEFT_SIDE) {
+        for(i=0; i<n; i++) {
+            right[i] = left[i] - right[i];
+        }
+    } else if(ch_mode == FLAC_CHMODE_RIGHT_SIDE) {
+        for(i=0; i<n; i++) {
+            left[i] = left[i] - right[i];
+        }
+    }
+}
+
 /**
  * Perform stereo channel decorrelation
  */
 static void
 channel_decorrelation(FlacEncodeContext *ctx)
 {
-    int i;
     FlacFrame *frame;
     int32_t *left, *right;
-    int32_t tmp;
 
     frame = &ctx->frame;
     left  = frame->subframes[0].samples;
@@ -688,29 +828,18 @@ channel_decorrelation(FlacEncodeContext *ctx)
     }
 
     // estimate stereo decorrelation type
-    frame->ch_mode = calc_decorr_scores(left, right, frame->blocksize);
+    frame->ch_mode = calc_decorr_scores(&ctx->dsp, left, right,
+                                        frame->blocksize);
 
     // perform decorrelation and adjust bits-per-sample
     if(frame->ch_mode == FLAC_CHMODE_LEFT_RIGHT) {
         return;
     }
-    if(frame->ch_mode == FLAC_CHMODE_MID_SIDE) {
-        for(i=0; i<frame->blocksize; i++) {
-            tmp = left[i];
-            left[i] = (left[i] + right[i]) >> 1;
-            right[i] = tmp - right[i];
-        }
-        frame->subframes[1].obits++;
-    } else if(frame->ch_mode == FLAC_CHMODE_LEFT_SIDE) {
-        for(i=0; i<frame->blocksize; i++) {
-            right[i] = left[i] - right[i];
-        }
-        frame->subframes[1].obits++;
-    } else if(frame->ch_mode == FLAC_CHMODE_RIGHT_SIDE) {
-        for(i=0; i<frame->blocksize; i++) {
-            left[i] = left[i] - right[i];
-        }
+    ctx->dsp.decorrelate_stereo(left, right, frame->blocksize, frame->ch_mode);
+    if(frame->ch_mode == FLAC_CHMODE_RIGHT_SIDE) {
         frame->subframes[0].obits++;
+    } else {
+        frame->subframes[1].obits++;
     }
 }
 
@@ -917,13 +1046,68 @@ output_subframes(FlacEncodeContext *ctx)
 static void
 output_frame_footer(FlacEncodeContext *ctx)
 {
-    uint16_t crc;
     bitwriter_flush(ctx->bw);
-    crc = calc_crc16(ctx->bw->buffer, bitwriter_count(ctx->bw));
-    bitwriter_writebits(ctx->bw, 16, crc);
+    // the bit writer has already accumulated the CRC of the whole frame
+    bitwriter_writebits(ctx->bw, 16, ctx->bw->crc16);
     bitwriter_flush(ctx->bw);
 }
 
+typedef struct SubframeJob {
+    FlacEncodeContext *ctx;
+    int ch;
+    int bits;
+    ThreadTask task;
+} SubframeJob;
+
+static void
+encode_residual_job(void *arg)
+{
+    SubframeJob *job = arg;
+
+    job->bits = encode_residual(job->ctx, job->ch);
+}
+
+/**
+ * Choose prediction and Rice parameters for each channel.  The channels are
+ * independent after decorrelation, so they can be analyzed concurrently.
+ */
+static int
+encode_subframes(FlacEncodeContext *ctx)
+{
+    int ch, err;
+    SubframeJob jobs[FLAC_MAX_CH];
+
+    if(ctx->pool == NULL || ctx->channels < 2 ||
+       !(ctx->params.thread_flags & FLAKE_THREAD_CHANNELS)) {
+        for(ch=0; ch<ctx->channels; ch++) {
+            if(encode_residual(ctx, ch) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // queue all but the last channel, which is analyzed on this thread
+    for(ch=0; ch<ctx->channels; ch++) {
+        jobs[ch].ctx = ctx;
+        jobs[ch].ch = ch;
+        if(ch < ctx->channels-1) {
+            threadpool_submit(ctx->pool, &jobs[ch].task, &ctx->pool_group,
+                              encode_residual_job, &jobs[ch]);
+        } else {
+            encode_residual_job(&jobs[ch]);
+        }
+    }
+    err = 0;
+    for(ch=0; ch<ctx->channels; ch++) {
+        if(ch < ctx->channels-1) {
+            threadpool_wait(ctx->pool, &jobs[ch].task);
+        }
+        if(jobs[ch].bits < 0) err = -1;
+    }
+    return err;
+}
+
 int
 encode_frame(FlakeContext *s, uint8_t *frame_buffer, int16_t *samples)
 {
@@ -939,18 +1123,17 @@ encode_frame(FlakeContext *s, uint8_t *frame_buffer, int16_t *samples)
     }
     s->params.block_size = ctx->params.block_size;
 
-    if(frame_buffer != NULL) {
-        update_md5_checksum(ctx, samples);
-    }
-
     copy_samples(ctx, samples);
 
     channel_decorrelation(ctx);
 
-    for(ch=0; ch<ctx->channels; ch++) {
-        if(encode_residual(ctx, ch) < 0) {
-            return -1;
-        }
+    if(ctx->params.prediction_type == FLAKE_PREDICTION_LEVINSON &&
+       lpc_windows_prepare(&ctx->windows, ctx->frame.blocksize,
+                           ctx->channels)) {
+        return -1;
+    }
+    if(encode_subframes(ctx) < 0) {
+        return -1;
     }
 
     bitwriter_init(ctx->bw, frame_buffer, ctx->max_frame_size);
@@ -982,8 +1165,12 @@ encode_frame(FlakeContext *s, uint8_t *frame_buffer, int16_t *samples)
     return bitwriter_count(ctx->bw);
 }
 
-int
-flake_encode_frame(FlakeContext *s, uint8_t *frame_buffer, int16_t *samples)
+/**
+ * Encode one block of input samples, splitting it into multiple frames if
+ * variable block size is enabled.  Does not update the MD5 checksum.
+ */
+static int
+encode_block(FlakeContext *s, uint8_t *frame_buffer, int16_t *samples)
 {
     int fs;
     FlacEncodeContext *ctx;
@@ -999,6 +1186,436 @@ flake_encode_frame(FlakeContext *s, uint8_t *frame_buffer, int16_t *samples)
     return fs;
 }
 
+int
+flake_encode_frame(FlakeContext *s, uint8_t *frame_buffer, int16_t *samples)
+{
+    int fs;
+    FlacEncodeContext *ctx;
+
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx == NULL) return -1;
+
+    fs = encode_block(s, frame_buffer, samples);
+    if(fs > 0 && frame_buffer != NULL) {
+        update_md5_checksum(ctx, samples, s->params.block_size);
+    }
+    return fs;
+}
+
+int
+copy_encode_context(FlacEncodeContext *dst, const FlacEncodeContext *src)
+{
+    int ch;
+
+    *dst = *src;
+    dst->jobs = NULL;
+    dst->job_count = 0;
+    dst->async = NULL;
+    dst->vbs_trials = NULL;
+    dst->vbs_trial_count = 0;
+    dst->queue_slots = 0;
+    memset(&dst->windows, 0, sizeof(LpcWindows));
+    dst->frame.buffer = NULL;
+    dst->frame.buffer_size = 0;
+    for(ch=0; ch<FLAC_MAX_CH; ch++) {
+        dst->frame.subframes[ch].samples = NULL;
+        dst->frame.subframes[ch].residual = NULL;
+    }
+    dst->order_residual = NULL;
+    dst->order_block_size = 0;
+    dst->bw = calloc(1, sizeof(BitWriter));
+    if(dst->bw == NULL) return -1;
+    return 0;
+}
+
+void
+free_context_buffers(FlacEncodeContext *ctx)
+{
+    lpc_windows_free(&ctx->windows);
+    if(ctx->bw) free(ctx->bw);
+    if(ctx->frame.buffer) free(ctx->frame.buffer);
+    if(ctx->order_residual) free(ctx->order_residual);
+}
+
+/**
+ * Allocate the private context and buffers of one frame queue slot.  Each
+ * slot gets a private copy of the encoding context with its own frame and
+ * bit writer.
+ */
+static void
+init_frame_job(void *arg)
+{
+    FlacFrameJob *job = arg;
+    FlacEncodeContext *ctx = job->owner;
+    FlacEncodeContext *jctx;
+
+    jctx = malloc(sizeof(FlacEncodeContext));
+    job->s.private_ctx = jctx;
+    if(jctx == NULL) return;
+    copy_encode_context(jctx, ctx);
+    jctx->queue_slots = ctx->job_count;
+    job->samples = malloc(ctx->job_block_size * ctx->channels * sizeof(int16_t));
+    job->frame_buffer = malloc(ctx->max_frame_size);
+}
+
+/**
+ * Allocate the frame queue used by flake_encode_submit.  If the workers are
+ * pinned to CPUs, the slots are set up by the workers, so that their scratch
+ * memory is first touched, and therefore placed, on the workers' NUMA nodes
+ * rather than all on the node of the calling thread.
+ * @param extra  number of slots to add to one per encoding thread
+ */
+static int
+init_frame_jobs(FlakeContext *s, int extra)
+{
+    int i, pinned;
+    FlacEncodeContext *ctx, *jctx;
+    FlacFrameJob *job;
+
+    ctx = (FlacEncodeContext *) s->private_ctx;
+
+    ctx->job_count = ctx->params.threads;
+    if(!ctx->pool_owned && ctx->pool != NULL) {
+        ctx->job_count = threadpool_threads(ctx->pool);
+    }
+    ctx->job_count += extra;
+    ctx->job_block_size = ctx->params.block_size;
+    ctx->job_first = 0;
+    ctx->jobs_pending = 0;
+    ctx->jobs = calloc(ctx->job_count, sizeof(FlacFrameJob));
+    if(ctx->jobs == NULL) return -1;
+
+    pinned = threadpool_pinned(ctx->pool);
+    for(i=0; i<ctx->job_count; i++) {
+        job = &ctx->jobs[i];
+        job->s = *s;
+        job->s.header = NULL;
+        job->s.private_ctx = NULL;
+        job->owner = ctx;
+        job->index = i;
+        if(pinned) {
+            threadpool_submit(ctx->pool, &job->task, &ctx->pool_group,
+                              init_frame_job, job);
+        } else {
+            init_frame_job(job);
+        }
+    }
+    for(i=0; i<ctx->job_count; i++) {
+        job = &ctx->jobs[i];
+        if(pinned) {
+            threadpool_wait(ctx->pool, &job->task);
+        }
+        jctx = (FlacEncodeContext *) job->s.private_ctx;
+        if(jctx == NULL || jctx->bw == NULL || job->samples == NULL ||
+           job->frame_buffer == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+free_frame_jobs(FlacEncodeContext *ctx)
+{
+    int i;
+    FlacEncodeContext *jctx;
+
+    if(ctx->jobs == NULL) return;
+
+    // finish any frames which are still being encoded
+    if(ctx->async != NULL) {
+        asyncqueue_drain(ctx->async);
+        asyncqueue_destroy(ctx->async);
+        ctx->async = NULL;
+    }
+    while(ctx->jobs_pending > 0) {
+        threadpool_wait(ctx->pool, &ctx->jobs[ctx->job_first].task);
+        ctx->job_first = (ctx->job_first + 1) % ctx->job_count;
+        ctx->jobs_pending--;
+    }
+
+    for(i=0; i<ctx->job_count; i++) {
+        jctx = (FlacEncodeContext *) ctx->jobs[i].s.private_ctx;
+        if(jctx) {
+            vbs_close(&ctx->jobs[i].s);
+            free_context_buffers(jctx);
+            free(jctx);
+        }
+        if(ctx->jobs[i].samples) free(ctx->jobs[i].samples);
+        if(ctx->jobs[i].frame_buffer) free(ctx->jobs[i].frame_buffer);
+    }
+    free(ctx->jobs);
+    ctx->jobs = NULL;
+}
+
+static void
+encode_frame_job(void *arg)
+{
+    FlacFrameJob *job = arg;
+
+    job->frame_size = encode_block(&job->s, job->frame_buffer, job->samples);
+}
+
+/**
+ * Copy a block of samples into a job slot.  Frame numbers and MD5 checksum
+ * depend only on submission order, so they are assigned here rather than by
+ * the worker threads.
+ */
+static void
+prepare_frame_job(FlakeContext *s, FlacFrameJob *job, int16_t *samples)
+{
+    int bs = s->params.block_size;
+    FlacEncodeContext *ctx, *jctx;
+
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    jctx = (FlacEncodeContext *) job->s.private_ctx;
+    job->s.params.block_size = bs;
+    jctx->params = ctx->params;
+    memcpy(job->samples, samples, bs * ctx->channels * sizeof(int16_t));
+
+    jctx->frame_count = ctx->frame_count;
+    if(ctx->params.variable_block_size) {
+        ctx->frame_count += bs;
+    } else {
+        ctx->frame_count++;
+    }
+    update_md5_checksum(ctx, samples, bs);
+}
+
+int
+flake_encode_submit(FlakeContext *s, int16_t *samples)
+{
+    int bs;
+    FlacEncodeContext *ctx;
+    FlacFrameJob *job;
+
+    if(s == NULL || samples == NULL) return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx == NULL || ctx->async != NULL) return -1;
+
+    if(ctx->jobs == NULL && init_frame_jobs(s, 0)) {
+        free_frame_jobs(ctx);
+        return -1;
+    }
+    if(ctx->jobs_pending >= governor_frames_in_flight(&ctx->gov,
+                                                      ctx->job_count)) {
+        return 1;
+    }
+    // flake_encode_collect waits out a hold, so one is only reported while
+    // there is a frame to collect
+    if(ctx->jobs_pending > 0 && governor_held(&ctx->gov)) {
+        return 1;
+    }
+    bs = s->params.block_size;
+    if(bs < 1 || bs > ctx->job_block_size) {
+        return -1;
+    }
+    governor_frame(&ctx->gov, &ctx->params, bs);
+
+    job = &ctx->jobs[(ctx->job_first + ctx->jobs_pending) % ctx->job_count];
+    prepare_frame_job(s, job, samples);
+
+    ctx->jobs_pending++;
+    threadpool_submit(ctx->pool, &job->task, &ctx->pool_group,
+                      encode_frame_job, job);
+
+    return 0;
+}
+
+/* called in stream order, never concurrently for one context */
+static void
+deliver_frame(void *opaque, int slot)
+{
+    FlacEncodeContext *ctx = opaque;
+    FlacFrameJob *job = &ctx->jobs[slot];
+
+    job->callback(job->opaque, (job->frame_size < 0) ? NULL : job->frame_buffer,
+                  job->frame_size, job->s.params.block_size);
+}
+
+static void
+finish_frame_job_async(void *arg)
+{
+    FlacFrameJob *job = arg;
+
+    asyncqueue_finish(job->owner->async, job->index);
+}
+
+int
+flake_encode_frame_async(FlakeContext *s, int16_t *samples,
+                         FlakeFrameCallback callback, void *opaque)
+{
+    int bs, slot;
+    FlacEncodeContext *ctx;
+    FlacFrameJob *job;
+
+    if(s == NULL || samples == NULL || callback == NULL) return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx == NULL || ctx->jobs_pending > 0) return -1;
+
+    // one slot more than the number of threads, so that a callback can
+    // queue the next block while its own slot is still being delivered
+    if(ctx->jobs == NULL && init_frame_jobs(s, 1)) {
+        free_frame_jobs(ctx);
+        return -1;
+    }
+    if(ctx->async == NULL) {
+        ctx->async = asyncqueue_create(ctx->job_count, deliver_frame, ctx);
+        if(ctx->async == NULL) return -1;
+    }
+    bs = s->params.block_size;
+    if(bs < 1 || bs > ctx->job_block_size) {
+        return -1;
+    }
+    // this may be called on a pool worker from a callback, so it must not
+    // wait for the governor
+    if(governor_held(&ctx->gov)) {
+        return 1;
+    }
+    slot = asyncqueue_reserve(ctx->async,
+                              governor_frames_in_flight(&ctx->gov,
+                                                        ctx->job_count-1));
+    if(slot < 0) {
+        return 1;
+    }
+    governor_frame(&ctx->gov, &ctx->params, bs);
+
+    job = &ctx->jobs[slot];
+    prepare_frame_job(s, job, samples);
+    job->callback = callback;
+    job->opaque = opaque;
+    threadpool_run(ctx->pool, &job->task, &ctx->pool_group,
+                   encode_frame_job, finish_frame_job_async, job);
+
+    return 0;
+}
+
+int
+flake_encode_collect(FlakeContext *s, uint8_t *frame_buffer, int *block_size)
+{
+    int fs;
+    FlacEncodeContext *ctx;
+    FlacFrameJob *job;
+
+    if(s == NULL) return -1;
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx == NULL) return -1;
+    if(ctx->jobs_pending == 0) return 0;
+
+    job = &ctx->jobs[ctx->job_first];
+    threadpool_wait(ctx->pool, &job->task);
+    ctx->job_first = (ctx->job_first + 1) % ctx->job_count;
+    ctx->jobs_pending--;
+    governor_wait(&ctx->gov);
+
+    fs = job->frame_size;
+    if(fs < 0) return -1;
+    if(frame_buffer != NULL) {
+        memcpy(frame_buffer, job->frame_buffer, fs);
+    }
+    if(block_size != NULL) {
+        *block_size = job->s.params.block_size;
+    }
+    return fs;
+}
+
+int
+flake_frame_renumber(const uint8_t *frame, int frame_size, unsigned int number,
+                     uint8_t *out)
+{
+    BitWriter bw;
+    int len, new_len, extra, crc_pos, new_crc_pos, bs_code, sr_code, size;
+    uint16_t crc;
+
+    if(frame == NULL || out == NULL || frame_size < 8) return -1;
+    if(frame[0] != 0xFF || (frame[1] & 0xFE) != 0xF8) return -1;
+
+    // length of the UTF-8 coded number which starts at byte 4
+    for(len=0; len<8 && (frame[4] & (0x80 >> len)); len++);
+    if(len == 0) {
+        len = 1;
+    } else if(len == 1 || len > 7) {
+        return -1;
+    }
+
+    // optional block size and sample rate follow the number
+    bs_code = frame[2] >> 4;
+    sr_code = frame[2] & 0x0F;
+    extra = 0;
+    if(bs_code == 6) extra += 1;
+    else if(bs_code == 7) extra += 2;
+    if(sr_code == 12) extra += 1;
+    else if(sr_code == 13 || sr_code == 14) extra += 2;
+    crc_pos = 4 + len + extra;
+    if(crc_pos + 3 > frame_size) return -1;
+
+    // write the new header and its CRC-8
+    memcpy(out, frame, 4);
+    bitwriter_init(&bw, &out[4], 16);
+    write_utf8(&bw, number);
+    bitwriter_flush(&bw);
+    new_len = bitwriter_count(&bw);
+    memcpy(&out[4+new_len], &frame[4+len], extra);
+    new_crc_pos = 4 + new_len + extra;
+    out[new_crc_pos] = calc_crc8(out, new_crc_pos);
+
+    // copy the subframes and recalculate the CRC-16 of the whole frame
+    size = frame_size - crc_pos + new_crc_pos;
+    memcpy(&out[new_crc_pos+1], &frame[crc_pos+1], frame_size - crc_pos - 3);
+    crc = calc_crc16(out, size-2);
+    out[size-2] = crc >> 8;
+    out[size-1] = crc & 0xFF;
+    return size;
+}
+
+struct FlakeMD5 {
+    MD5Context ctx;
+};
+
+FlakeMD5 *
+flake_md5_create(void)
+{
+    FlakeMD5 *m = malloc(sizeof(FlakeMD5));
+    if(m != NULL) {
+        md5_init(&m->ctx);
+    }
+    return m;
+}
+
+void
+flake_md5_update(FlakeMD5 *m, const int16_t *samples, int channels,
+                 int block_size)
+{
+    md5_accumulate(&m->ctx, samples, channels, block_size);
+}
+
+void
+flake_md5_close(FlakeMD5 *m, uint8_t *digest)
+{
+    md5_final(digest, &m->ctx);
+    free(m);
+}
+
+FlakePool *
+flake_pool_create(int threads)
+{
+    if(threads < 1 || threads > FLAC_MAX_THREADS) return NULL;
+    return threadpool_create(threads, 0);
+}
+
+FlakePool *
+flake_pool_create_pinned(int threads)
+{
+    if(threads < 1 || threads > FLAC_MAX_THREADS) return NULL;
+    return threadpool_create(threads, 1);
+}
+
+void
+flake_pool_destroy(FlakePool *pool)
+{
+    threadpool_destroy(pool);
+}
+
 void
 flake_encode_close(FlakeContext *s)
 {
@@ -1008,8 +1625,14 @@ flake_encode_close(FlakeContext *s)
     if(s->private_ctx == NULL) return;
     ctx = (FlacEncodeContext *) s->private_ctx;
     if(ctx) {
+        free_frame_jobs(ctx);
+        vbs_close(s);
+        if(ctx->pool_owned) {
+            threadpool_destroy(ctx->pool);
+        }
+        hashthread_finish(ctx->md5_thread);
         md5_final(s->md5digest, &ctx->md5ctx);
-        if(ctx->bw) free(ctx->bw);
+        free_context_buffers(ctx);
         free(ctx);
     }
     if(s->header) free(s->header);
@@ -27,8 +27,14 @@
 #include "rice.h"
 #include "lpc.h"
 #include "md5.h"
+#include "async.h"
+#include "governor.h"
+#include "hash.h"
+#include "thread.h"
+#include "dsp.h"
 
 #define FLAC_MAX_CH  8
+#define FLAC_MAX_THREADS  64
 #define FLAC_MIN_BLOCKSIZE  16
 #define FLAC_MAX_BLOCKSIZE  65535
 
@@ -54,8 +60,8 @@ typedef struct FlacSubframe {
     int obits;
     int32_t coefs[MAX_LPC_ORDER];
     int shift;
-    int32_t samples[FLAC_MAX_BLOCKSIZE];
-    int32_t residual[FLAC_MAX_BLOCKSIZE];
+    int32_t *samples;
+    int32_t *residual;
     RiceContext rc;
 } FlacSubframe;
 
@@ -66,8 +72,28 @@ typedef struct FlacFrame {
     int ch_order[2];
     uint8_t crc8;
     FlacSubframe subframes[FLAC_MAX_CH];
+    int32_t *buffer;            // holds the samples and residual of each subframe
+    int buffer_size;            // samples per channel the buffer can hold
 } FlacFrame;
 
+/**
+ * One slot in the queue of frames waiting to be encoded by worker threads.
+ * Each slot owns a copy of the user context which points to its own
+ * FlacEncodeContext, so concurrent frames never share frame or bit writer
+ * scratch.
+ */
+typedef struct FlacFrameJob {
+    FlakeContext s;
+    int16_t *samples;
+    uint8_t *frame_buffer;
+    int frame_size;
+    ThreadTask task;
+    struct FlacEncodeContext *owner;
+    int index;
+    FlakeFrameCallback callback;    // set for frames queued asynchronously
+    void *opaque;
+} FlacFrameJob;
+
 typedef struct FlacEncodeContext {
     int channels;
     int ch_code;
@@ -82,9 +108,41 @@ typedef struct FlacEncodeContext {
     uint32_t frame_count;
     FlacFrame frame;
     MD5Context md5ctx;
+    HashThread *md5_thread;
     struct BitWriter *bw;
+    ThreadPool *pool;
+    int pool_owned;
+    ThreadGroup pool_group;
+    FlacFrameJob *jobs;
+    int job_count;
+    int job_first;
+    int jobs_pending;
+    int job_block_size;
+    AsyncQueue *async;
+    Governor gov;
+    DSPContext dsp;
+    LpcWindows windows;
+    struct VbsTrialJob *vbs_trials;
+    int vbs_trial_count;
+    int32_t *order_residual;    // scratch for concurrent order evaluation
+    int order_block_size;
+    int queue_slots;            // in a frame queue slot, the number of slots
 } FlacEncodeContext;
 
 extern int encode_frame(FlakeContext *s, uint8_t *frame_buffer, int16_t *samples);
 
+/**
+ * Set up dst as a private copy of the encoding context src, for encoding
+ * frames alongside it.  The copy gets its own bit writer, and allocates its
+ * own frame buffers and LPC windows as it encodes.
+ * @return 0 on success, -1 on failure (dst can still be passed to
+ *         free_context_buffers)
+ */
+extern int copy_encode_context(FlacEncodeContext *dst, const FlacEncodeContext *src);
+
+/**
+ * Free the buffers owned by an encoding context, but not the context itself.
+ */
+extern void free_context_buffers(FlacEncodeContext *ctx);
+
 #endif /* FLAC_H */
@@ -41,6 +41,33 @@
 #define FLAKE_PREDICTION_FIXED     1
 #define FLAKE_PREDICTION_LEVINSON  2
 
+#define FLAKE_THREAD_CHANNELS  0x01
+#define FLAKE_THREAD_ORDERS    0x02
+#define FLAKE_THREAD_VBS       0x04
+#define FLAKE_THREAD_MD5       0x08
+#define FLAKE_THREAD_ALL       (FLAKE_THREAD_CHANNELS | FLAKE_THREAD_ORDERS | \
+                                FLAKE_THREAD_VBS | FLAKE_THREAD_MD5)
+
+#define FLAKE_PRIORITY_LOW       0
+#define FLAKE_PRIORITY_NORMAL    1
+#define FLAKE_PRIORITY_REALTIME  2
+
+#define FLAKE_CPU_SSE41   0x01
+#define FLAKE_CPU_AVX2    0x02
+#define FLAKE_CPU_AVX512  0x04     // AVX-512 F, BW and VL; reserved, no
+                                   // kernels use it yet
+#define FLAKE_CPU_BMI2    0x08     // reserved, no kernels use it yet
+#define FLAKE_CPU_ALL     (FLAKE_CPU_SSE41 | FLAKE_CPU_AVX2 | \
+                           FLAKE_CPU_AVX512 | FLAKE_CPU_BMI2)
+
+/**
+ * Pool of worker threads which may be shared by several encoder contexts.
+ * Frames from all contexts using a pool are scheduled on the same threads:
+ * by priority class first, then taking turns between the contexts of a
+ * class.  Each context still collects its frames in order.
+ */
+typedef struct FlakePool FlakePool;
+
 typedef struct FlakeEncodeParams {
 
     // compression quality
@@ -132,6 +159,75 @@ typedef struct FlakeEncodeParams {
     // 1 = variable block size
     int variable_block_size;
 
+    // number of encoding threads
+    // set by user prior to calling flake_encode_init
+    // frames queued with flake_encode_submit are encoded concurrently by
+    // this many threads.  valid values are 0 to 64
+    // 0 or 1 = encode frames on the calling thread
+    int threads;
+
+    // work inside each frame to split across the encoding threads
+    // set by user prior to calling flake_encode_init
+    // only used if threads is greater than 1
+    // bitwise OR of:
+    // FLAKE_THREAD_CHANNELS = analyze the channels of a frame concurrently
+    // FLAKE_THREAD_ORDERS   = evaluate candidate prediction orders concurrently
+    //                         (order methods 2 to 6)
+    // FLAKE_THREAD_VBS      = run the trial encodes of variable block size
+    //                         method 2 concurrently.  frames queued with
+    //                         flake_encode_submit only do so when the pool
+    //                         has at least two workers per queue slot.
+    // FLAKE_THREAD_MD5      = compute the MD5 checksum on a separate thread.
+    //                         this is also used if threads is 1.
+    int thread_flags;
+
+    // shared worker pool
+    // set by user prior to calling flake_encode_init
+    // if NULL, the encoder starts its own pool based on threads.  otherwise
+    // threads is ignored and frames are encoded by the workers of this pool,
+    // which must not be destroyed before flake_encode_close is called.
+    FlakePool *pool;
+
+    // scheduling priority of this stream's frames
+    // set by user prior to calling flake_encode_init
+    // only matters when several streams share a pool.  queued frames of a
+    // higher class are always encoded first.
+    // 0 = low, e.g. backfill
+    // 1 = normal (default)
+    // 2 = realtime
+    int priority;
+
+    // worker thread placement
+    // set by user prior to calling flake_encode_init
+    // only used if the encoder starts its own pool
+    // 0 = leave placement to the OS (default)
+    // 1 = pin each worker to one of the CPUs the process may run on, in turn.
+    //     frame scratch memory is then allocated by the workers, so that it
+    //     is local to their NUMA nodes.
+    int affinity;
+
+    // CPU budget, in percent of one CPU
+    // set by user prior to calling flake_encode_init
+    // only applies to frames queued with flake_encode_submit or
+    // flake_encode_frame_async.  if greater than 0, no more frames than the
+    // budget has whole CPUs are encoded at once, queuing of frames is held
+    // back when the average use goes over the budget, and order_method and
+    // max_partition_order are lowered while the CPU time needed per second of
+    // audio is close to the budget, so that a live stream keeps up.  they are
+    // never raised above the values set here.  valid values are 0 to 6400
+    // 0 = no limit (default)
+    int cpu_budget;
+
+    // CPU features optimized kernels may use (sum of FLAKE_CPU_* flags)
+    // set by user prior to calling flake_encode_init
+    // features the running CPU does not have are never used.  the FLAKE_CPU
+    // environment variable, if set to a list of names separated by commas
+    // (none, sse4.1, avx2, avx512, bmi2, all), limits them further.  every
+    // choice gives the same output.
+    // 0 = portable C only
+    // FLAKE_CPU_ALL = any the CPU has (default)
+    int cpu_flags;
+
 } FlakeEncodeParams;
 
 typedef struct FlakeContext {
@@ -193,6 +289,129 @@ extern int flake_encode_init(FlakeContext *s);
 extern int flake_encode_frame(FlakeContext *s, unsigned char *frame_buffer,
                               short *samples);
 
+/**
+ * Queues one block of s->params.block_size samples for encoding.  The samples
+ * are copied, so the buffer may be reused once this returns.  Up to
+ * params.threads blocks can be pending at once.  Frames queued this way are
+ * numbered and checksummed in submission order, so do not mix this with
+ * flake_encode_frame on the same context.
+ * @return 0 if queued, 1 if the queue is full, or the CPU budget holds back
+ *         queuing, and the oldest frame must be collected first, -1 on error
+ */
+extern int flake_encode_submit(FlakeContext *s, short *samples);
+
+/**
+ * Retrieves the oldest pending frame, waiting for it to finish if needed.
+ * Frames are always returned in the order they were submitted.  With a CPU
+ * budget, this also waits while the budget holds back queuing.
+ * @param block_size if not NULL, set to the number of samples in the frame
+ * @return frame size in bytes, 0 if no frames are pending, -1 on error
+ */
+extern int flake_encode_collect(FlakeContext *s, unsigned char *frame_buffer,
+                                int *block_size);
+
+/**
+ * Receives a finished frame queued with flake_encode_frame_async.
+ * @param frame       encoded frame, or NULL if encoding failed.  only valid
+ *                    until the callback returns.
+ * @param frame_size  frame size in bytes, or -1 on error
+ * @param block_size  number of samples in the frame
+ */
+typedef void (*FlakeFrameCallback)(void *opaque, const unsigned char *frame,
+                                   int frame_size, int block_size);
+
+/**
+ * Queues one block of s->params.block_size samples for encoding and returns
+ * without waiting.  The samples are copied.  Each finished frame is passed to
+ * the callback, in submission order, on the thread which finished it: a pool
+ * worker, or the calling thread if the context has no worker threads.
+ * Callbacks for one context never overlap.  A callback may wake an event
+ * loop through a pipe or eventfd, or queue the next block itself if no other
+ * thread is calling into the context meanwhile.  It must not close the
+ * context.  flake_encode_close waits for all queued frames to be delivered.
+ * Do not mix this with flake_encode_submit or flake_encode_frame on the same
+ * context.
+ * @return 0 if queued, 1 if all queue slots are in use and a callback must
+ *         return before another block can be queued, or if the CPU budget
+ *         holds back queuing and the call should be retried a little
+ *         later, -1 on error
+ */
+extern int flake_encode_frame_async(FlakeContext *s, short *samples,
+                                    FlakeFrameCallback callback, void *opaque);
+
 extern void flake_encode_close(FlakeContext *s);
 
+/**
+ * Functions for threads and CPU features.
+ */
+
+/**
+ * Thread safety
+ *
+ * libflake has no global mutable state.  Any number of FlakeContext instances
+ * may be initialized, used and closed concurrently from different threads.
+ *
+ * A single FlakeContext is not locked internally.  Calls on one context must
+ * not overlap; they may come from different threads if the caller orders
+ * them.  Encoder threads started by the library only call back into user
+ * code to deliver frames queued with flake_encode_frame_async.
+ *
+ * A FlakePool may be shared by contexts used from any threads.  It must not
+ * be destroyed until every context using it has been closed.
+ */
+
+/**
+ * Starts a pool of worker threads, to be given to encoders in params.pool.
+ * @param threads  number of worker threads, 1 to 64
+ * @return the new pool, or NULL on error
+ */
+extern FlakePool *flake_pool_create(int threads);
+
+/**
+ * Same as flake_pool_create, but with the workers pinned to CPUs as with
+ * params.affinity = 1.  To use only some of the CPUs, restrict the CPUs the
+ * process may run on before calling this.
+ */
+extern FlakePool *flake_pool_create_pinned(int threads);
+
+/**
+ * Stops the worker threads and frees the pool.  Every context using the pool
+ * must be closed first.
+ */
+extern void flake_pool_destroy(FlakePool *pool);
+
+/**
+ * Returns the FLAKE_CPU_* features of the running CPU which libflake has
+ * optimized kernels for, limited to those named in the FLAKE_CPU environment
+ * variable if it is set.  Encoders never use features outside this set.
+ */
+extern int flake_get_cpu_flags(void);
+
+/**
+ * Functions for assembling one stream from separately encoded parts.
+ */
+
+/**
+ * Copies an encoded frame to out, replacing the frame number in its header
+ * (the sample number for variable block size streams) and recalculating both
+ * CRCs.  The length of the coded number may change, so out must have room
+ * for frame_size + 6 bytes, and must not overlap frame.
+ * @return new frame size, or -1 if frame is not a valid frame
+ */
+extern int flake_frame_renumber(const unsigned char *frame, int frame_size,
+                                unsigned int number, unsigned char *out);
+
+/**
+ * MD5 checksum of 16-bit input audio, as stored in the stream header.
+ * flake_md5_close frees the context and writes the 16-byte digest.
+ */
+typedef struct FlakeMD5 FlakeMD5;
+
+extern FlakeMD5 *flake_md5_create(void);
+
+extern void flake_md5_update(FlakeMD5 *m, const short *samples, int channels,
+                             int block_size);
+
+extern void flake_md5_close(FlakeMD5 *m, unsigned char *digest);
+
 #endif /* FLAKE_H */
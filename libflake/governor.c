@@ -0,0 +1,185 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file governor.c
+ * Keeps encoding within a CPU budget by adjusting concurrency and effort
+ */
+
+#include "common.h"
+
+#ifdef HAVE_CPU_CLOCK
+#include <time.h>
+#endif
+
+#include "governor.h"
+
+/* length of a measurement window, in ns */
+#define GOVERNOR_WINDOW 250000000
+
+/* order methods from cheapest to most expensive */
+static const int order_methods[] = {
+    FLAKE_ORDER_METHOD_EST,
+    FLAKE_ORDER_METHOD_2LEVEL,
+    FLAKE_ORDER_METHOD_4LEVEL,
+    FLAKE_ORDER_METHOD_LOG,
+    FLAKE_ORDER_METHOD_8LEVEL,
+    FLAKE_ORDER_METHOD_SEARCH
+};
+
+static int64_t
+wall_time(void)
+{
+#ifdef HAVE_CPU_CLOCK
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts)) return 0;
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static void
+sleep_ns(int64_t ns)
+{
+#ifdef HAVE_CPU_CLOCK
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+void
+governor_init(Governor *g, const FlakeEncodeParams *params, int sample_rate)
+{
+    int i, rank, om, porder, min_porder;
+
+    memset(g, 0, sizeof(Governor));
+    g->budget = params->cpu_budget;
+    g->sample_rate = sample_rate;
+
+    // walk down from the requested settings: first to cheaper order
+    // methods, then to lower partition orders
+    om = params->order_method;
+    porder = params->max_partition_order;
+    min_porder = MAX(params->min_partition_order, 2);
+    rank = -1;
+    for(i=0; i<6; i++) {
+        if(order_methods[i] == om) rank = i;
+    }
+    for(i=GOVERNOR_STEPS-1; i>=0; i--) {
+        g->order_method[i] = om;
+        g->max_porder[i] = porder;
+        g->steps++;
+        if(rank > 0) {
+            om = order_methods[--rank];
+        } else if(porder > min_porder) {
+            porder--;
+        } else {
+            break;
+        }
+    }
+    // move the steps to the start of the arrays
+    if(g->steps < GOVERNOR_STEPS) {
+        memmove(g->order_method, &g->order_method[GOVERNOR_STEPS-g->steps],
+                g->steps * sizeof(int));
+        memmove(g->max_porder, &g->max_porder[GOVERNOR_STEPS-g->steps],
+                g->steps * sizeof(int));
+    }
+    g->level = g->steps-1;
+}
+
+int
+governor_frames_in_flight(Governor *g, int max_frames)
+{
+    if(g->budget <= 0) return max_frames;
+    return CLIP((g->budget + 99) / 100, 1, max_frames);
+}
+
+void
+governor_frame(Governor *g, FlakeEncodeParams *params, int block_size)
+{
+    int64_t now, elapsed, cpu, used, allowed, audio;
+    int need;
+
+    if(g->budget <= 0) return;
+
+    now = wall_time();
+    if(g->window_start == 0) {
+        g->window_start = now;
+        g->window_cpu = __atomic_load_n(&g->cpu_time, __ATOMIC_RELAXED);
+    }
+    g->window_samples += block_size;
+    elapsed = now - g->window_start;
+    if(elapsed < GOVERNOR_WINDOW) return;
+
+    // hold back further frames until average use is within the budget.
+    // the next window starts once the hold is over.
+    cpu = __atomic_load_n(&g->cpu_time, __ATOMIC_RELAXED);
+    used = cpu - g->window_cpu;
+    allowed = elapsed * g->budget / 100;
+    g->hold_until = 0;
+    if(used > allowed) {
+        g->hold_until = now + (used - allowed) * 100 / g->budget;
+    }
+
+    // CPU needed to keep up with the audio in real time, in percent of one
+    // CPU.  when this nears the budget, search less; with plenty of room,
+    // search more, up to the requested settings.
+    audio = (int64_t)g->window_samples * 1000000000 / g->sample_rate;
+    if(audio > 0) {
+        need = (int)MIN(used * 100 / audio, INT32_MAX);
+        if(need > g->budget * 9 / 10 && g->level > 0) {
+            g->level--;
+        } else if(need < g->budget / 2 && g->level < g->steps-1) {
+            g->level++;
+        }
+        params->order_method = g->order_method[g->level];
+        params->max_partition_order = g->max_porder[g->level];
+    }
+
+    g->window_start = MAX(now, g->hold_until);
+    g->window_cpu = cpu;
+    g->window_samples = 0;
+}
+
+int
+governor_held(Governor *g)
+{
+    if(g->hold_until == 0) return 0;
+    if(wall_time() < g->hold_until) return 1;
+    g->hold_until = 0;
+    return 0;
+}
+
+void
+governor_wait(Governor *g)
+{
+    int64_t now;
+
+    if(g->hold_until == 0) return;
+    now = wall_time();
+    if(now < g->hold_until) {
+        sleep_ns(g->hold_until - now);
+    }
+    g->hold_until = 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file governor.h
+ * Keeps encoding within a CPU budget by adjusting concurrency and effort
+ */
+
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include "common.h"
+#include "flake.h"
+
+#define GOVERNOR_STEPS 16
+
+typedef struct Governor {
+    int budget;                         // in percent of one CPU, 0 if unlimited
+    int sample_rate;
+    int level;                          // current effort step
+    int steps;
+    int order_method[GOVERNOR_STEPS];   // effort steps, cheapest first
+    int max_porder[GOVERNOR_STEPS];
+    int64_t cpu_time;                   // CPU time of all frames in ns, added
+                                        // to by the threads encoding them
+    int64_t window_start;               // wall clock time, in ns
+    int64_t hold_until;                 // wall clock time before which no
+                                        // frame should be queued, or 0
+    int64_t window_cpu;
+    uint32_t window_samples;
+} Governor;
+
+/**
+ * Sets up the governor for a CPU budget.  The effort steps run from the
+ * cheapest search settings up to those in params, which the encoder starts
+ * with.
+ */
+extern void governor_init(Governor *g, const FlakeEncodeParams *params,
+                          int sample_rate);
+
+/**
+ * Returns how many of max_frames frames may be encoded at once.
+ */
+extern int governor_frames_in_flight(Governor *g, int max_frames);
+
+/**
+ * Called before each frame is queued.  Once per measurement window, holds
+ * back queuing for a while if more CPU time than the budget allows has been
+ * used, then moves the search settings in params one step down if the CPU
+ * time needed per second of audio is close to the budget, or one step up if
+ * it is well below.  This never waits.
+ */
+extern void governor_frame(Governor *g, FlakeEncodeParams *params,
+                           int block_size);
+
+/**
+ * Returns 1 if queuing is being held back, otherwise 0.
+ */
+extern int governor_held(Governor *g);
+
+/**
+ * Waits until queuing is no longer held back.  Only for callers which are
+ * allowed to block.
+ */
+extern void governor_wait(Governor *g);
+
+#endif /* GOVERNOR_H */
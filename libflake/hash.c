@@ -0,0 +1,182 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file hash.c
+ * MD5 checksum of the input audio, computed on a background thread
+ */
+
+#include "common.h"
+
+#include "hash.h"
+
+#ifdef HAVE_PTHREADS
+
+#include <pthread.h>
+
+/* number of blocks which may be queued for hashing */
+#define HASH_BUFFERS 4
+
+struct HashThread {
+    MD5Context *md5ctx;
+    int channels;
+    int16_t *buffers[HASH_BUFFERS];
+    int buffer_size[HASH_BUFFERS];    // in samples per channel
+    int block_size[HASH_BUFFERS];
+    unsigned int read_pos;
+    unsigned int write_pos;
+    int pending;
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+static void *
+hash_thread(void *arg)
+{
+    HashThread *ht = arg;
+    int i;
+
+    pthread_mutex_lock(&ht->lock);
+    for(;;) {
+        while(ht->pending == 0 && !ht->quit) {
+            pthread_cond_wait(&ht->cond, &ht->lock);
+        }
+        if(ht->pending == 0) break;
+        i = ht->read_pos % HASH_BUFFERS;
+        pthread_mutex_unlock(&ht->lock);
+
+        md5_accumulate(ht->md5ctx, ht->buffers[i], ht->channels,
+                       ht->block_size[i]);
+
+        pthread_mutex_lock(&ht->lock);
+        ht->read_pos++;
+        ht->pending--;
+        pthread_cond_broadcast(&ht->cond);
+    }
+    pthread_mutex_unlock(&ht->lock);
+    return NULL;
+}
+
+static void
+hashthread_free(HashThread *ht)
+{
+    int i;
+
+    for(i=0; i<HASH_BUFFERS; i++) {
+        if(ht->buffers[i]) free(ht->buffers[i]);
+    }
+    pthread_cond_destroy(&ht->cond);
+    pthread_mutex_destroy(&ht->lock);
+    free(ht);
+}
+
+HashThread *
+hashthread_create(MD5Context *md5ctx, int channels, int block_size)
+{
+    HashThread *ht;
+    int i;
+
+    ht = calloc(1, sizeof(HashThread));
+    if(ht == NULL) return NULL;
+    ht->md5ctx = md5ctx;
+    ht->channels = channels;
+    pthread_mutex_init(&ht->lock, NULL);
+    pthread_cond_init(&ht->cond, NULL);
+    for(i=0; i<HASH_BUFFERS; i++) {
+        ht->buffers[i] = malloc(block_size * channels * sizeof(int16_t));
+        if(ht->buffers[i] == NULL) {
+            hashthread_free(ht);
+            return NULL;
+        }
+        ht->buffer_size[i] = block_size;
+    }
+    if(pthread_create(&ht->thread, NULL, hash_thread, ht)) {
+        hashthread_free(ht);
+        return NULL;
+    }
+    return ht;
+}
+
+int
+hashthread_push(HashThread *ht, const int16_t *samples, int block_size)
+{
+    int i;
+
+    // wait for a free buffer.  only this thread advances write_pos, so the
+    // buffer at write_pos belongs to it once pending is below the limit.
+    pthread_mutex_lock(&ht->lock);
+    while(ht->pending == HASH_BUFFERS) {
+        pthread_cond_wait(&ht->cond, &ht->lock);
+    }
+    pthread_mutex_unlock(&ht->lock);
+
+    i = ht->write_pos % HASH_BUFFERS;
+    if(block_size > ht->buffer_size[i]) {
+        int16_t *buf = realloc(ht->buffers[i],
+                               block_size * ht->channels * sizeof(int16_t));
+        if(buf == NULL) return -1;
+        ht->buffers[i] = buf;
+        ht->buffer_size[i] = block_size;
+    }
+    memcpy(ht->buffers[i], samples, block_size * ht->channels * sizeof(int16_t));
+    ht->block_size[i] = block_size;
+
+    pthread_mutex_lock(&ht->lock);
+    ht->write_pos++;
+    ht->pending++;
+    pthread_cond_broadcast(&ht->cond);
+    pthread_mutex_unlock(&ht->lock);
+    return 0;
+}
+
+void
+hashthread_finish(HashThread *ht)
+{
+    if(ht == NULL) return;
+
+    pthread_mutex_lock(&ht->lock);
+    ht->quit = 1;
+    pthread_cond_broadcast(&ht->cond);
+    pthread_mutex_unlock(&ht->lock);
+    pthread_join(ht->thread, NULL);
+    hashthread_free(ht);
+}
+
+#else /* HAVE_PTHREADS */
+
+HashThread *
+hashthread_create(MD5Context *md5ctx, int channels, int block_size)
+{
+    return NULL;
+}
+
+int
+hashthread_push(HashThread *ht, const int16_t *samples, int block_size)
+{
+    return -1;
+}
+
+void
+hashthread_finish(HashThread *ht)
+{
+}
+
+#endif /* HAVE_PTHREADS */
@@ -0,0 +1,55 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file hash.h
+ * MD5 checksum of the input audio, computed on a background thread
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include "common.h"
+#include "md5.h"
+
+typedef struct HashThread HashThread;
+
+/**
+ * Starts a thread which accumulates audio blocks into an MD5 context.  The
+ * context must not be used by the caller until hashthread_finish() returns.
+ * @return NULL if threads are not supported or could not be created
+ */
+extern HashThread *hashthread_create(MD5Context *md5ctx, int channels,
+                                     int block_size);
+
+/**
+ * Queues a block of samples to be hashed.  The samples are copied into one of
+ * a fixed set of recycled buffers, so this only blocks if the hashing thread
+ * has fallen behind by all of them.
+ * @return -1 on error
+ */
+extern int hashthread_push(HashThread *ht, const int16_t *samples,
+                           int block_size);
+
+/**
+ * Waits for all queued blocks to be hashed, then stops the thread.
+ */
+extern void hashthread_finish(HashThread *ht);
+
+#endif /* HASH_H */
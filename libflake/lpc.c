@@ -21,12 +21,38 @@
 
 #include "flake.h"
 #include "lpc.h"
+#include "dsp.h"
+
+/* alignment of window tables and windowed samples, for SIMD loads */
+#define WINDOW_ALIGN 64
+
+static double *
+alloc_aligned(int count)
+{
+    void *mem;
+    uint8_t *p;
+
+    // the offset to the allocation is kept in the byte before the result
+    mem = malloc(count * sizeof(double) + WINDOW_ALIGN);
+    if(mem == NULL) return NULL;
+    p = (uint8_t *)mem + WINDOW_ALIGN - ((uintptr_t)mem & (WINDOW_ALIGN-1));
+    p[-1] = (uint8_t)(p - (uint8_t *)mem);
+    return (double *)p;
+}
+
+static void
+free_aligned(double *ptr)
+{
+    uint8_t *p = (uint8_t *)ptr;
+
+    if(p != NULL) free(p - p[-1]);
+}
 
 /**
- * Apply Welch window function to audio block
+ * Welch window function for a block of len samples
  */
-static inline void
-apply_welch_window(const int32_t *data, int len, double *w_data)
+static void
+calc_welch_window(int len, double *w_data)
 {
     int i;
     double c;
@@ -34,26 +60,85 @@ apply_welch_window(const int32_t *data, int len, double *w_data)
     c = (2.0 / (len - 1.0)) - 1.0;
     for(i=0; i<(len >> 1); i++) {
         double w = 1.0 - ((c-i) * (c-i));
-        w_data[i] = data[i] * w;
-        w_data[len-1-i] = data[len-1-i] * w;
+        w_data[i] = w;
+        w_data[len-1-i] = w;
+    }
+    // the middle sample of an odd-length block is not covered by the loop,
+    // and is left out of the analysis
+    if(len & 1) {
+        w_data[len >> 1] = 0.0;
+    }
+}
+
+int
+lpc_windows_prepare(LpcWindows *lw, int len, int channels)
+{
+    int i, stride;
+
+    // windowed samples are followed by a zero, and each channel's start is
+    // kept aligned
+    stride = (len + 8) & ~7;
+    if(stride > lw->stride || channels > lw->channels) {
+        free_aligned(lw->scratch);
+        lw->stride = MAX(stride, lw->stride);
+        lw->channels = MAX(channels, lw->channels);
+        lw->scratch = alloc_aligned(lw->stride * lw->channels);
+        if(lw->scratch == NULL) {
+            lw->stride = lw->channels = 0;
+            return -1;
+        }
+    }
+
+    for(i=0; i<LPC_WINDOWS; i++) {
+        if(lw->table[i] != NULL && lw->len[i] == len) {
+            lw->window = lw->table[i];
+            return 0;
+        }
+    }
+    i = lw->next;
+    lw->next = (lw->next + 1) % LPC_WINDOWS;
+    free_aligned(lw->table[i]);
+    lw->table[i] = alloc_aligned(len);
+    if(lw->table[i] == NULL) return -1;
+    lw->len[i] = len;
+    calc_welch_window(len, lw->table[i]);
+    lw->window = lw->table[i];
+    return 0;
+}
+
+void
+lpc_windows_free(LpcWindows *lw)
+{
+    int i;
+
+    for(i=0; i<LPC_WINDOWS; i++) {
+        free_aligned(lw->table[i]);
+    }
+    free_aligned(lw->scratch);
+    memset(lw, 0, sizeof(LpcWindows));
+}
+
+void
+apply_window_c(const int32_t *data, const double *window, int len,
+               double *w_data)
+{
+    int i;
+
+    for(i=0; i<len; i++) {
+        w_data[i] = data[i] * window[i];
     }
 }
 
 /**
- * Calculates autocorrelation data from audio samples
- * A Welch window function is applied before calculation.
+ * Calculates autocorrelation data from windowed audio samples
+ * data[len] must be 0.
  */
-static void
-compute_autocorr(const int32_t *data, int len, int lag, double *autoc)
+void
+compute_autocorr_c(const double *data1, int len, int lag, double *autoc)
 {
     int i, j;
-    double *data1;
     double temp, temp2;
 
-    data1 = malloc((len+16) * sizeof(double));
-    apply_welch_window(data, len, data1);
-    data1[len] = 0;
-
     for (i=0; i<=lag; ++i) {
         temp = 1.0;
         temp2 = 1.0;
@@ -66,8 +151,23 @@ compute_autocorr(const int32_t *data, int len, int lag, double *autoc)
         }
         autoc[i] = temp + temp2;
     }
+}
+
+/**
+ * Calculates autocorrelation data from audio samples of channel ch
+ * The window prepared for the frame is applied before calculation.
+ */
+static void
+compute_autocorr(const DSPContext *dsp, LpcWindows *lw, int ch,
+                 const int32_t *data, int len, int lag, double *autoc)
+{
+    double *data1;
+
+    data1 = &lw->scratch[ch * lw->stride];
+    dsp->apply_window(data, lw->window, len, data1);
+    data1[len] = 0;
 
-    free(data1);
+    dsp->compute_autocorr(data1, len, lag, autoc);
 }
 
 /**
@@ -223,16 +323,18 @@ quantize_lpc_coefs(double *lpc_in, int order, int precision, int32_t *lpc_out,
  * Calculate LPC coefficients for multiple orders
  */
 int
-lpc_calc_coefs(const int32_t *samples, int blocksize, int max_order,
+lpc_calc_coefs(const DSPContext *dsp, LpcWindows *lw, int ch,
+               const int32_t *samples, int blocksize, int max_order,
                int precision, int omethod, int32_t coefs[][MAX_LPC_ORDER],
                int *shift)
 {
-    double autoc[MAX_LPC_ORDER+1];
+    // lags 0 to max_order+1 are computed
+    double autoc[MAX_LPC_ORDER+2];
     double lpc[MAX_LPC_ORDER][MAX_LPC_ORDER];
     int i;
     int opt_order;
 
-    compute_autocorr(samples, blocksize, max_order+1, autoc);
+    compute_autocorr(dsp, lw, ch, samples, blocksize, max_order+1, autoc);
 
     opt_order = max_order;
     if(omethod == FLAKE_ORDER_METHOD_EST) {
@@ -24,7 +24,33 @@
 
 #define MAX_LPC_ORDER 32
 
-extern int lpc_calc_coefs(const int32_t *samples, int blocksize, int max_order,
+/* number of block sizes with cached windows */
+#define LPC_WINDOWS    8
+
+struct DSPContext;
+
+/**
+ * Welch windows for recently used block sizes, and a buffer for the windowed
+ * samples of each channel.  Each encoder context has its own.  The window
+ * for a frame is looked up by lpc_windows_prepare before its channels are
+ * analyzed, which may then happen concurrently.
+ */
+typedef struct LpcWindows {
+    int len[LPC_WINDOWS];
+    double *table[LPC_WINDOWS];
+    int next;                   // entry to replace next
+    const double *window;       // window for the current frame
+    double *scratch;
+    int stride;                 // scratch samples per channel
+    int channels;
+} LpcWindows;
+
+extern int lpc_windows_prepare(LpcWindows *lw, int len, int channels);
+
+extern void lpc_windows_free(LpcWindows *lw);
+
+extern int lpc_calc_coefs(const struct DSPContext *dsp, LpcWindows *lw, int ch,
+                          const int32_t *samples, int blocksize, int max_order,
                           int precision, int omethod,
                           int32_t coefs[][MAX_LPC_ORDER], int *shift);
 
@@ -24,6 +24,8 @@
 #include "encode.h"
 #include "lpc.h"
 #include "rice.h"
+#include "thread.h"
+#include "dsp.h"
 
 static void
 encode_residual_verbatim(int32_t res[], int32_t smp[], int n)
@@ -74,9 +76,9 @@ encode_residual_fixed(int32_t res[], int32_t smp[], int n, int order)
     }
 }
 
-static void
-encode_residual_lpc(int32_t res[], int32_t smp[], int n, int order,
-                    int32_t coefs[], int shift)
+void
+encode_residual_lpc_c(int32_t *res, const int32_t *smp, int n, int order,
+                      const int32_t *coefs, int shift)
 {
     int i;
     int32_t pred;
@@ -128,6 +130,156 @@ encode_residual_lpc(int32_t res[], int32_t smp[], int n, int order,
     }
 }
 
+/**
+ * Same as encode_residual_lpc_c, with the prediction in 64 bits
+ */
+void
+encode_residual_lpc_wide_c(int32_t *res, const int32_t *smp, int n, int order,
+                           const int32_t *coefs, int shift)
+{
+    int i, j;
+    int64_t pred;
+
+    for(i=0; i<order; i++) {
+        res[i] = smp[i];
+    }
+    for(i=order; i<n; i++) {
+        pred = 0;
+        for(j=0; j<order; j++) {
+            pred += (int64_t)coefs[j] * smp[i-j-1];
+        }
+        res[i] = smp[i] - (int32_t)(pred >> shift);
+    }
+}
+
+/**
+ * Calculates LPC residual.  The 32-bit kernel is used unless the prediction
+ * for samples of obits bits could overflow it.
+ */
+static void
+encode_residual_lpc(FlacEncodeContext *ctx, int32_t *res, const int32_t *smp,
+                    int n, int order, const int32_t *coefs, int shift,
+                    int obits)
+{
+    int i;
+    int64_t csum;
+
+    csum = 0;
+    for(i=0; i<order; i++) {
+        csum += ABS(coefs[i]);
+    }
+    if((csum << (obits-1)) > INT32_MAX) {
+        ctx->dsp.encode_residual_lpc_wide(res, smp, n, order, coefs, shift);
+    } else {
+        ctx->dsp.encode_residual_lpc(res, smp, n, order, coefs, shift);
+    }
+}
+
+/**
+ * Make sure the residual scratch for concurrent evaluation of candidate
+ * orders holds blocks of blocksize samples: one block per candidate for each
+ * channel, since the channels of a frame may also be analyzed concurrently.
+ * Nothing is allocated unless order threading is enabled.
+ */
+int
+alloc_order_residual(FlacEncodeContext *ctx, int blocksize)
+{
+    if(ctx->pool == NULL || !(ctx->params.thread_flags & FLAKE_THREAD_ORDERS)) {
+        return 0;
+    }
+    if(ctx->order_residual != NULL && blocksize <= ctx->order_block_size) {
+        return 0;
+    }
+    if(ctx->order_residual) free(ctx->order_residual);
+    ctx->order_block_size = 0;
+    ctx->order_residual = malloc((size_t)ctx->channels * MAX_LPC_ORDER *
+                                 blocksize * sizeof(int32_t));
+    if(ctx->order_residual == NULL) return -1;
+    ctx->order_block_size = blocksize;
+    return 0;
+}
+
+typedef struct OrderJob {
+    FlacEncodeContext *ctx;
+    FlacSubframe *sub;
+    int32_t *res;
+    int n;
+    int order;
+    int32_t *coefs;
+    int shift;
+    uint32_t bits;
+    ThreadTask task;
+} OrderJob;
+
+static void
+calc_order_bits_job(void *arg)
+{
+    OrderJob *job = arg;
+    FlacEncodeContext *ctx = job->ctx;
+    RiceContext rc;
+
+    encode_residual_lpc(ctx, job->res, job->sub->samples, job->n, job->order,
+                        job->coefs, job->shift, job->sub->obits);
+    job->bits = calc_rice_params_lpc(&ctx->dsp, &rc,
+                                     ctx->params.min_partition_order,
+                                     ctx->params.max_partition_order, job->res,
+                                     job->n, job->order, job->sub->obits,
+                                     ctx->lpc_precision);
+}
+
+/**
+ * Calculate the number of bits needed to encode a subframe with each of the
+ * candidate LPC orders.  Orders are given as coefficient indices (order-1).
+ * The candidates are independent, so if order threading is enabled they are
+ * evaluated concurrently, each into its own block of the channel's order
+ * scratch.
+ */
+static void
+calc_lpc_order_bits(FlacEncodeContext *ctx, int ch, int n,
+                    const int *orders, int count,
+                    int32_t coefs[][MAX_LPC_ORDER], int *shift, uint32_t *bits)
+{
+    int i;
+    FlacSubframe *sub = &ctx->frame.subframes[ch];
+    OrderJob jobs[MAX_LPC_ORDER];
+
+    if(ctx->order_residual == NULL || count < 2 ||
+       n > ctx->order_block_size) {
+        for(i=0; i<count; i++) {
+            encode_residual_lpc(ctx, sub->residual, sub->samples, n,
+                                orders[i]+1, coefs[orders[i]],
+                                shift[orders[i]], sub->obits);
+            bits[i] = calc_rice_params_lpc(&ctx->dsp, &sub->rc,
+                                           ctx->params.min_partition_order,
+                                           ctx->params.max_partition_order,
+                                           sub->residual, n, orders[i]+1,
+                                           sub->obits, ctx->lpc_precision);
+        }
+        return;
+    }
+
+    for(i=0; i<count; i++) {
+        jobs[i].ctx = ctx;
+        jobs[i].sub = sub;
+        jobs[i].res = &ctx->order_residual[(ch*MAX_LPC_ORDER + i) * n];
+        jobs[i].n = n;
+        jobs[i].order = orders[i]+1;
+        jobs[i].coefs = coefs[orders[i]];
+        jobs[i].shift = shift[orders[i]];
+        if(i > 0) {
+            threadpool_submit(ctx->pool, &jobs[i].task, &ctx->pool_group,
+                              calc_order_bits_job, &jobs[i]);
+        }
+    }
+    calc_order_bits_job(&jobs[0]);
+    for(i=0; i<count; i++) {
+        if(i > 0) {
+            threadpool_wait(ctx->pool, &jobs[i].task);
+        }
+        bits[i] = jobs[i].bits;
+    }
+}
+
 int
 encode_residual(FlacEncodeContext *ctx, int ch)
 {
@@ -173,32 +325,22 @@ encode_residual(FlacEncodeContext *ctx, int ch)
 
     // FIXED
     if(ctx->params.prediction_type == FLAKE_PREDICTION_FIXED || n <= max_order) {
-        uint32_t bits[5];
-        if(max_order > 4) max_order = 4;
-        opt_order = min_order;
-        bits[opt_order] = UINT32_MAX;
-        for(i=min_order; i<=max_order; i++) {
-            encode_residual_fixed(res, smp, n, i);
-            bits[i] = calc_rice_params_fixed(&sub->rc, min_porder, max_porder, res,
-                                             n, i, sub->obits);
-            if(bits[i] < bits[opt_order]) {
-                opt_order = i;
-            }
-        }
-        sub->order = opt_order;
+        uint32_t bits;
+        if(max_order > MAX_FIXED_ORDER) max_order = MAX_FIXED_ORDER;
+        if(min_order > max_order) min_order = max_order;
+        // only the residual of the chosen order is calculated
+        sub->order = calc_rice_params_fixed(&ctx->dsp, &sub->rc, min_porder,
+                                            max_porder, smp, n, min_order,
+                                            max_order, sub->obits, &bits);
         sub->type = FLAC_SUBFRAME_FIXED;
         sub->type_code = sub->type | sub->order;
-        if(sub->order != max_order) {
-            encode_residual_fixed(res, smp, n, sub->order);
-            return calc_rice_params_fixed(&sub->rc, min_porder, max_porder, res, n,
-                                          sub->order, sub->obits);
-        }
-        return bits[sub->order];
+        encode_residual_fixed(res, smp, n, sub->order);
+        return bits;
     }
 
     // LPC
-    est_order = lpc_calc_coefs(smp, n, max_order, ctx->lpc_precision,
-                               omethod, coefs, shift);
+    est_order = lpc_calc_coefs(&ctx->dsp, &ctx->windows, ch, smp, n, max_order,
+                               ctx->lpc_precision, omethod, coefs, shift);
 
     if(omethod == FLAKE_ORDER_METHOD_MAX) {
         // always use maximum order
@@ -211,33 +353,32 @@ encode_residual(FlacEncodeContext *ctx, int ch)
               omethod == FLAKE_ORDER_METHOD_8LEVEL) {
         int levels = 1 << (omethod-1);
         uint32_t bits[8];
-        int order;
-        int opt_index = levels-1;
-        opt_order = max_order-1;
-        bits[opt_index] = UINT32_MAX;
-        for(i=opt_index; i>=0; i--) {
-            order = min_order + (((max_order-min_order+1) * (i+1)) / levels)-1;
-            if(order < 0) order = 0;
-            encode_residual_lpc(res, smp, n, order+1, coefs[order], shift[order]);
-            bits[i] = calc_rice_params_lpc(&sub->rc, min_porder, max_porder,
-                                           res, n, order+1, sub->obits,
-                                           ctx->lpc_precision);
+        int orders[8];
+        int opt_index;
+        // candidates are evaluated from highest to lowest order
+        for(i=0; i<levels; i++) {
+            int level = levels-1-i;
+            orders[i] = min_order + (((max_order-min_order+1) * (level+1)) / levels)-1;
+            orders[i] = CLIP(orders[i], min_order-1, max_order-1);
+        }
+        calc_lpc_order_bits(ctx, ch, n, orders, levels, coefs, shift, bits);
+        opt_index = 0;
+        for(i=1; i<levels; i++) {
             if(bits[i] < bits[opt_index]) {
                 opt_index = i;
-                opt_order = order;
             }
         }
-        opt_order++;
+        opt_order = orders[opt_index]+1;
     } else if(omethod == FLAKE_ORDER_METHOD_SEARCH) {
         // brute-force optimal order search
         uint32_t bits[MAX_LPC_ORDER];
-        opt_order = 0;
-        bits[0] = UINT32_MAX;
+        int orders[MAX_LPC_ORDER];
         for(i=0; i<max_order; i++) {
-            encode_residual_lpc(res, smp, n, i+1, coefs[i], shift[i]);
-            bits[i] = calc_rice_params_lpc(&sub->rc, min_porder, max_porder,
-                                           res, n, i+1, sub->obits,
-                                           ctx->lpc_precision);
+            orders[i] = i;
+        }
+        calc_lpc_order_bits(ctx, ch, n, orders, max_order, coefs, shift, bits);
+        opt_order = 0;
+        for(i=1; i<max_order; i++) {
             if(bits[i] < bits[opt_order]) {
                 opt_order = i;
             }
@@ -246,22 +387,27 @@ encode_residual(FlacEncodeContext *ctx, int ch)
     } else if(omethod == FLAKE_ORDER_METHOD_LOG) {
         // log search (written by Michael Niedermayer for FFmpeg)
         uint32_t bits[MAX_LPC_ORDER];
-        int step;
+        uint32_t step_bits[3];
+        int orders[3];
+        int step, count;
 
         opt_order = min_order - 1 + (max_order-min_order)/3;
         memset(bits, -1, sizeof(bits));
 
         for(step=16; step>0; step>>=1){
             int last = opt_order;
+            count = 0;
             for(i=last-step; i<=last+step; i+= step){
                 if(i<min_order-1 || i>=max_order || bits[i] < UINT32_MAX)
                     continue;
-                encode_residual_lpc(res, smp, n, i+1, coefs[i], shift[i]);
-                bits[i] = calc_rice_params_lpc(&sub->rc, min_porder, max_porder,
-                                               res, n, i+1, sub->obits,
-                                               ctx->lpc_precision);
-                if(bits[i] < bits[opt_order]) {
-                    opt_order = i;
+                orders[count++] = i;
+            }
+            calc_lpc_order_bits(ctx, ch, n, orders, count, coefs, shift,
+                                step_bits);
+            for(i=0; i<count; i++) {
+                bits[orders[i]] = step_bits[i];
+                if(bits[orders[i]] < bits[opt_order]) {
+                    opt_order = orders[i];
                 }
             }
         }
@@ -277,9 +423,11 @@ encode_residual(FlacEncodeContext *ctx, int ch)
     for(i=0; i<sub->order; i++) {
         sub->coefs[i] = coefs[sub->order-1][i];
     }
-    encode_residual_lpc(res, smp, n, sub->order, sub->coefs, sub->shift);
-    return calc_rice_params_lpc(&sub->rc, min_porder, max_porder, res, n,
-                                sub->order, sub->obits, ctx->lpc_precision);
+    encode_residual_lpc(ctx, res, smp, n, sub->order, sub->coefs, sub->shift,
+                        sub->obits);
+    return calc_rice_params_lpc(&ctx->dsp, &sub->rc, min_porder, max_porder,
+                                res, n, sub->order, sub->obits,
+                                ctx->lpc_precision);
 }
 
 void
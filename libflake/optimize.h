@@ -24,6 +24,8 @@
 
 #include "encode.h"
 
+extern int alloc_order_residual(FlacEncodeContext *ctx, int blocksize);
+
 extern int encode_residual(FlacEncodeContext *ctx, int ch);
 
 extern void reencode_residual_verbatim(FlacEncodeContext *ctx, int ch);
@@ -25,6 +25,7 @@
 #include "common.h"
 
 #include "rice.h"
+#include "dsp.h"
 
 int
 find_optimal_rice_param(uint32_t sum, int n)
@@ -68,13 +69,13 @@ calc_optimal_rice_params(RiceContext *rc, int porder, uint32_t *sums,
     return all_bits;
 }
 
-static void
-calc_sums(int pmin, int pmax, uint32_t *data, int n, int pred_order,
-          uint32_t sums[][MAX_PARTITIONS])
+void
+calc_sums_c(int pmin, int pmax, const int32_t *data, int n, int pred_order,
+            uint32_t sums[][MAX_PARTITIONS])
 {
     int i, j;
     int parts, cnt;
-    uint32_t *res;
+    const int32_t *res;
 
     // sums for highest level
     parts = (1 << pmax);
@@ -85,7 +86,7 @@ calc_sums(int pmin, int pmax, uint32_t *data, int n, int pred_order,
         if(i > 0) res = &data[i*cnt];
         sums[pmax][i] = 0;
         for(j=0; j<cnt; j++) {
-            sums[pmax][i] += res[j];
+            sums[pmax][i] += (2*res[j]) ^ (res[j]>>31);
         }
     }
     // sums for lower levels
@@ -97,27 +98,67 @@ calc_sums(int pmin, int pmax, uint32_t *data, int n, int pred_order,
     }
 }
 
+/**
+ * Calculates partition sums of the Rice-mapped residual of each fixed
+ * prediction order from 0 to MAX_FIXED_ORDER at partition order porder.
+ * Sample i is in partition i >> porder for every order, but only counts
+ * for the orders which have a residual at i.
+ */
+void
+calc_fixed_sums_c(const int32_t *smp, int n, int porder,
+                  uint32_t sums[][MAX_PARTITIONS])
+{
+    int i, o, p, parts, psize, end;
+    int32_t r[MAX_FIXED_ORDER+1], prev[MAX_FIXED_ORDER+1];
+
+    parts = (1 << porder);
+    psize = (n >> porder);
+    for(o=0; o<=MAX_FIXED_ORDER; o++) {
+        memset(sums[o], 0, parts * sizeof(uint32_t));
+    }
+
+    // first samples of the block, which are warm-up for the higher orders.
+    // the residual of order o is the difference of order o-1 residuals.
+    for(i=0; i<MAX_FIXED_ORDER; i++) {
+        p = i / psize;
+        r[0] = smp[i];
+        for(o=1; o<=i; o++) {
+            r[o] = r[o-1] - prev[o-1];
+        }
+        for(o=0; o<=i; o++) {
+            sums[o][p] += (2*r[o]) ^ (r[o]>>31);
+            prev[o] = r[o];
+        }
+    }
+
+    for(p=0; p<parts; p++) {
+        i = MAX(p*psize, MAX_FIXED_ORDER);
+        end = (p+1) * psize;
+        for(; i<end; i++) {
+            r[0] = smp[i];
+            r[1] = smp[i] - smp[i-1];
+            r[2] = smp[i] - 2*smp[i-1] + smp[i-2];
+            r[3] = smp[i] - 3*smp[i-1] + 3*smp[i-2] - smp[i-3];
+            r[4] = smp[i] - 4*smp[i-1] + 6*smp[i-2] - 4*smp[i-3] + smp[i-4];
+            for(o=0; o<=MAX_FIXED_ORDER; o++) {
+                sums[o][p] += (2*r[o]) ^ (r[o]>>31);
+            }
+        }
+    }
+}
+
+/**
+ * Chooses the partition order from pmin to pmax which needs the fewest bits,
+ * given the partition sums for each of them
+ */
 static uint32_t
-calc_rice_params(RiceContext *rc, int pmin, int pmax, int32_t *data, int n,
-                 int pred_order)
+calc_rice_params_sums(RiceContext *rc, int pmin, int pmax,
+                      uint32_t sums[][MAX_PARTITIONS], int n, int pred_order)
 {
     int i;
     uint32_t bits[MAX_PARTITION_ORDER+1];
     int opt_porder;
     RiceContext tmp_rc;
-    uint32_t *udata;
-    uint32_t sums[MAX_PARTITION_ORDER+1][MAX_PARTITIONS];
-
-    assert(pmin >= 0 && pmin <= MAX_PARTITION_ORDER);
-    assert(pmax >= 0 && pmax <= MAX_PARTITION_ORDER);
-    assert(pmin <= pmax);
-
-    udata = malloc(n * sizeof(uint32_t));
-    for(i=0; i<n; i++) {
-        udata[i] = (2*data[i]) ^ (data[i]>>31);
-    }
-
-    calc_sums(pmin, pmax, udata, n, pred_order, sums);
 
     opt_porder = pmin;
     bits[pmin] = UINT32_MAX;
@@ -129,10 +170,23 @@ calc_rice_params(RiceContext *rc, int pmin, int pmax, int32_t *data, int n,
         }
     }
 
-    free(udata);
     return bits[opt_porder];
 }
 
+static uint32_t
+calc_rice_params(const DSPContext *dsp, RiceContext *rc, int pmin, int pmax,
+                 const int32_t *data, int n, int pred_order)
+{
+    uint32_t sums[MAX_PARTITION_ORDER+1][MAX_PARTITIONS];
+
+    assert(pmin >= 0 && pmin <= MAX_PARTITION_ORDER);
+    assert(pmax >= 0 && pmax <= MAX_PARTITION_ORDER);
+    assert(pmin <= pmax);
+
+    dsp->calc_sums(pmin, pmax, data, n, pred_order, sums);
+    return calc_rice_params_sums(rc, pmin, pmax, sums, n, pred_order);
+}
+
 static int
 get_max_p_order(int max_porder, int n, int order)
 {
@@ -142,26 +196,63 @@ get_max_p_order(int max_porder, int n, int order)
     return porder;
 }
 
-uint32_t
-calc_rice_params_fixed(RiceContext *rc, int pmin, int pmax, int32_t *data,
-                       int n, int pred_order, int bps)
+/**
+ * Finds the fixed prediction order from min_order to max_order which needs
+ * the fewest bits, along with its Rice parameters.  The partition sums of
+ * all the orders come from one pass over the samples, and no residual is
+ * written.
+ */
+int
+calc_rice_params_fixed(const DSPContext *dsp, RiceContext *rc, int pmin,
+                       int pmax, const int32_t *smp, int n, int min_order,
+                       int max_order, int bps, uint32_t *bits)
 {
-    uint32_t bits;
-    pmin = get_max_p_order(pmin, n, pred_order);
-    pmax = get_max_p_order(pmax, n, pred_order);
-    bits = pred_order*bps + 6;
-    bits += calc_rice_params(rc, pmin, pmax, data, n, pred_order);
-    return bits;
+    int i, j, o, opt_order, top, omin, omax;
+    uint32_t obits, opt_bits;
+    uint32_t fsums[MAX_FIXED_ORDER+1][MAX_PARTITIONS];
+    uint32_t sums[MAX_PARTITION_ORDER+1][MAX_PARTITIONS];
+    RiceContext tmp_rc;
+
+    assert(min_order >= 0 && max_order <= MAX_FIXED_ORDER);
+    assert(min_order <= max_order);
+
+    // the lowest order allows the most partitions
+    top = get_max_p_order(pmax, n, min_order);
+    dsp->calc_fixed_sums(smp, n, top, fsums);
+
+    opt_order = min_order;
+    opt_bits = UINT32_MAX;
+    for(o=min_order; o<=max_order; o++) {
+        omin = get_max_p_order(pmin, n, o);
+        omax = get_max_p_order(pmax, n, o);
+        // sums for lower levels
+        memcpy(sums[top], fsums[o], (1 << top) * sizeof(uint32_t));
+        for(i=top-1; i>=omin; i--) {
+            for(j=0; j<(1 << i); j++) {
+                sums[i][j] = sums[i+1][2*j] + sums[i+1][2*j+1];
+            }
+        }
+        obits = o*bps + 6;
+        obits += calc_rice_params_sums(&tmp_rc, omin, omax, sums, n, o);
+        if(obits < opt_bits) {
+            opt_order = o;
+            opt_bits = obits;
+            *rc = tmp_rc;
+        }
+    }
+    *bits = opt_bits;
+    return opt_order;
 }
 
 uint32_t
-calc_rice_params_lpc(RiceContext *rc, int pmin, int pmax, int32_t *data, int n,
-                     int pred_order, int bps, int precision)
+calc_rice_params_lpc(const DSPContext *dsp, RiceContext *rc, int pmin,
+                     int pmax, int32_t *data, int n, int pred_order, int bps,
+                     int precision)
 {
     uint32_t bits;
     pmin = get_max_p_order(pmin, n, pred_order);
     pmax = get_max_p_order(pmax, n, pred_order);
     bits = pred_order*bps + 4 + 5 + pred_order*precision + 6;
-    bits += calc_rice_params(rc, pmin, pmax, data, n, pred_order);
+    bits += calc_rice_params(dsp, rc, pmin, pmax, data, n, pred_order);
     return bits;
 }
@@ -30,6 +30,7 @@
 #define MAX_RICE_PARAM          14
 #define MAX_PARTITION_ORDER     8
 #define MAX_PARTITIONS          (1 << MAX_PARTITION_ORDER)
+#define MAX_FIXED_ORDER         4
 
 typedef struct RiceContext {
     int porder;                     /* partition order */
@@ -39,13 +40,17 @@ typedef struct RiceContext {
 
 #define rice_encode_count(sum, n, k) (((n)*((k)+1))+(((sum)-(n>>1))>>(k)))
 
+struct DSPContext;
+
 extern int find_optimal_rice_param(uint32_t sum, int n);
 
-extern uint32_t calc_rice_params_fixed(RiceContext *rc, int pmin, int pmax,
-                                       int32_t *data, int n, int pred_order,
-                                       int bps);
+extern int calc_rice_params_fixed(const struct DSPContext *dsp,
+                                  RiceContext *rc, int pmin, int pmax,
+                                  const int32_t *smp, int n, int min_order,
+                                  int max_order, int bps, uint32_t *bits);
 
-extern uint32_t calc_rice_params_lpc(RiceContext *rc, int pmin, int pmax,
+extern uint32_t calc_rice_params_lpc(const struct DSPContext *dsp,
+                                     RiceContext *rc, int pmin, int pmax,
                                      int32_t *data, int n, int pred_order,
                                      int bps, int precision);
 
@@ -0,0 +1,646 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file thread.c
+ * Worker thread pool used for concurrent encoding
+ */
+
+/* for sched_getaffinity and pthread_setaffinity_np */
+#define _GNU_SOURCE
+
+#include "common.h"
+
+#ifdef HAVE_CPU_CLOCK
+#include <time.h>
+#endif
+
+#include "thread.h"
+
+int64_t
+thread_cpu_time(void)
+{
+#ifdef HAVE_CPU_CLOCK
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) return 0;
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/* adds the CPU time of one task to its group's counter */
+static void
+charge_cpu_time(int64_t *cpu_time, int64_t used)
+{
+    if(cpu_time != NULL && used > 0) {
+        __atomic_add_fetch(cpu_time, used, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+init_task(ThreadTask *task, const ThreadGroup *group, void (*func)(void *arg),
+          void (*finish)(void *arg), void *arg)
+{
+    task->func = func;
+    task->finish = finish;
+    task->arg = arg;
+    task->group = group->id;
+    task->priority = group->priority;
+    task->cpu_time = group->cpu_time;
+    task->done = 0;
+}
+
+/**
+ * Runs a task on the calling thread, for use without a pool.  Tasks never
+ * nest in that case, so the whole time is charged to the task.
+ */
+static void
+run_inline(ThreadTask *task)
+{
+    int64_t start = 0;
+
+    if(task->cpu_time != NULL) start = thread_cpu_time();
+    task->func(task->arg);
+    if(task->cpu_time != NULL) {
+        charge_cpu_time(task->cpu_time, thread_cpu_time() - start);
+    }
+    if(task->finish != NULL) {
+        task->finish(task->arg);
+    } else {
+        task->done = 1;
+    }
+}
+
+#ifdef HAVE_PTHREADS
+
+#include <pthread.h>
+#ifdef HAVE_THREAD_AFFINITY
+#include <sched.h>
+#endif
+
+/**
+ * Double-ended task queue.  The owning worker pushes and pops at the bottom,
+ * other threads steal from the top.
+ */
+typedef struct TaskDeque {
+    pthread_mutex_t lock;
+    ThreadTask *top, *bottom;
+} TaskDeque;
+
+typedef struct Worker {
+    struct FlakePool *pool;
+    int index;
+    int cpu;                // CPU the worker is pinned to, or -1
+    pthread_t thread;
+} Worker;
+
+struct FlakePool {
+    pthread_mutex_t lock;   // protects queued, quit, groups and task->done
+    pthread_cond_t cond;    // signaled when a task is queued or finished
+    TaskDeque *deques;      // one per worker, followed by the shared deque
+    int ndeques;
+    Worker *workers;
+    int nthreads;
+    int pinned;
+    int queued[THREAD_PRIORITIES];
+    int quit;
+    unsigned int next_group;
+    unsigned int last_group[THREAD_PRIORITIES]; // last group served per class
+    pthread_key_t self;
+    pthread_key_t timing;   // TaskTiming of the task running on this thread
+};
+
+/**
+ * CPU time accounting of a running task.  A thread which waits for a task
+ * runs other tasks meanwhile, so their time is subtracted from the outer
+ * task to charge each group only for its own work.
+ */
+typedef struct TaskTiming {
+    int64_t nested;
+} TaskTiming;
+
+static void
+deque_push_bottom(TaskDeque *dq, ThreadTask *task)
+{
+    pthread_mutex_lock(&dq->lock);
+    task->next = NULL;
+    task->prev = dq->bottom;
+    if(dq->bottom != NULL) {
+        dq->bottom->next = task;
+    } else {
+        dq->top = task;
+    }
+    dq->bottom = task;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/* removes a task from a deque.  the deque lock must be held. */
+static void
+deque_unlink(TaskDeque *dq, ThreadTask *task)
+{
+    if(task->prev != NULL) {
+        task->prev->next = task->next;
+    } else {
+        dq->top = task->next;
+    }
+    if(task->next != NULL) {
+        task->next->prev = task->prev;
+    } else {
+        dq->bottom = task->prev;
+    }
+}
+
+static ThreadTask *
+deque_pop_bottom(TaskDeque *dq, int min_priority)
+{
+    ThreadTask *task;
+
+    pthread_mutex_lock(&dq->lock);
+    task = dq->bottom;
+    if(task != NULL) {
+        if(task->priority >= min_priority) {
+            deque_unlink(dq, task);
+        } else {
+            task = NULL;
+        }
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+/**
+ * Scheduling order of a task; lower values run first.  Higher priority
+ * classes always run first.  Within a class, groups are served in rotation,
+ * starting with the next group after the one served last, so that every
+ * stream gets its turn however many streams share the pool.
+ */
+static uint64_t
+task_order(ThreadTask *task, const unsigned int *last_group)
+{
+    unsigned int rank = task->group - last_group[task->priority] - 1;
+    return ((uint64_t)(THREAD_PRIORITIES - 1 - task->priority) << 32) | rank;
+}
+
+/**
+ * Steal the task which is first in scheduling order.  Only the top task of
+ * another worker's deque may be stolen, but any task in the shared deque may
+ * be taken, since it holds the frames of all streams fed from outside the
+ * pool.  Tasks below min_priority are left alone.
+ */
+static ThreadTask *
+steal_task(ThreadPool *pool, int self, int min_priority)
+{
+    int i, victim;
+    unsigned int last_group[THREAD_PRIORITIES];
+    uint64_t order, best = 0;
+    TaskDeque *dq;
+    ThreadTask *task, *shared;
+
+    pthread_mutex_lock(&pool->lock);
+    memcpy(last_group, pool->last_group, sizeof(last_group));
+    pthread_mutex_unlock(&pool->lock);
+
+    for(;;) {
+        victim = -1;
+        for(i=0; i<pool->ndeques-1; i++) {
+            if(i == self) continue;
+            dq = &pool->deques[i];
+            pthread_mutex_lock(&dq->lock);
+            task = dq->top;
+            if(task != NULL && task->priority >= min_priority) {
+                order = task_order(task, last_group);
+                if(victim < 0 || order < best) {
+                    victim = i;
+                    best = order;
+                }
+            }
+            pthread_mutex_unlock(&dq->lock);
+        }
+
+        // take from the shared deque if it has the first task
+        dq = &pool->deques[pool->ndeques-1];
+        shared = NULL;
+        pthread_mutex_lock(&dq->lock);
+        for(task=dq->top; task != NULL; task=task->next) {
+            if(task->priority < min_priority) continue;
+            order = task_order(task, last_group);
+            if((victim < 0 && shared == NULL) || order < best) {
+                shared = task;
+                best = order;
+            }
+        }
+        if(shared != NULL) {
+            deque_unlink(dq, shared);
+        }
+        pthread_mutex_unlock(&dq->lock);
+        if(shared != NULL) return shared;
+        if(victim < 0) return NULL;
+
+        // the top task may have been taken since the scan.  if so, rescan.
+        dq = &pool->deques[victim];
+        pthread_mutex_lock(&dq->lock);
+        task = dq->top;
+        if(task != NULL && task->priority >= min_priority) {
+            deque_unlink(dq, task);
+        } else {
+            task = NULL;
+        }
+        pthread_mutex_unlock(&dq->lock);
+        if(task != NULL) return task;
+    }
+}
+
+/**
+ * Take the next task to run: the newest task on the caller's own deque if it
+ * is a worker, otherwise a stolen one.
+ * @param self  worker index, or -1 if called from outside the pool
+ * @param min_priority  lowest priority class to take a task from
+ */
+static ThreadTask *
+get_task(ThreadPool *pool, int self, int min_priority)
+{
+    ThreadTask *task = NULL;
+    int stolen = 0;
+
+    if(self >= 0) {
+        task = deque_pop_bottom(&pool->deques[self], min_priority);
+    }
+    if(task == NULL) {
+        task = steal_task(pool, self, min_priority);
+        stolen = 1;
+    }
+    if(task != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued[task->priority]--;
+        if(stolen) {
+            pool->last_group[task->priority] = task->group;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return task;
+}
+
+/* number of queued tasks of at least min_priority.  pool->lock must be held. */
+static int
+queued_tasks(ThreadPool *pool, int min_priority)
+{
+    int i, n = 0;
+
+    for(i=min_priority; i<THREAD_PRIORITIES; i++) {
+        n += pool->queued[i];
+    }
+    return n;
+}
+
+static void
+run_task(ThreadPool *pool, ThreadTask *task)
+{
+    TaskTiming timing, *outer;
+    int64_t start = 0, used;
+    int timed;
+
+    outer = pthread_getspecific(pool->timing);
+    timed = (task->cpu_time != NULL || outer != NULL);
+    if(timed) {
+        timing.nested = 0;
+        pthread_setspecific(pool->timing, &timing);
+        start = thread_cpu_time();
+    }
+    task->func(task->arg);
+    if(timed) {
+        used = thread_cpu_time() - start;
+        pthread_setspecific(pool->timing, outer);
+        if(outer != NULL) outer->nested += used;
+        charge_cpu_time(task->cpu_time, used - timing.nested);
+    }
+
+    // a detached task may be reused as soon as finish is called, so it must
+    // not be touched afterwards
+    if(task->finish != NULL) {
+        task->finish(task->arg);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    task->done = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static int
+worker_index(ThreadPool *pool)
+{
+    Worker *w = pthread_getspecific(pool->self);
+    return (w != NULL) ? w->index : -1;
+}
+
+static void *
+worker_thread(void *arg)
+{
+    Worker *w = arg;
+    ThreadPool *pool = w->pool;
+    ThreadTask *task;
+    int quit;
+
+#ifdef HAVE_THREAD_AFFINITY
+    if(w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+    pthread_setspecific(pool->self, w);
+    for(;;) {
+        task = get_task(pool, w->index, 0);
+        if(task != NULL) {
+            run_task(pool, task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while(queued_tasks(pool, 0) == 0 && !pool->quit) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        quit = (pool->quit && queued_tasks(pool, 0) == 0);
+        pthread_mutex_unlock(&pool->lock);
+        if(quit) break;
+    }
+    return NULL;
+}
+
+/**
+ * Choose a CPU for each worker, going round the CPUs the process is allowed
+ * to run on.  The allowed set can be narrowed beforehand, e.g. with taskset
+ * or a cpuset, to keep the workers on one node.
+ * @return 0 if the workers will be pinned
+ */
+static int
+assign_cpus(ThreadPool *pool, int nthreads)
+{
+#ifdef HAVE_THREAD_AFFINITY
+    cpu_set_t set;
+    int i, cpu, count;
+
+    if(sched_getaffinity(0, sizeof(set), &set)) return -1;
+    count = CPU_COUNT(&set);
+    if(count < 1) return -1;
+    cpu = -1;
+    for(i=0; i<nthreads; i++) {
+        do {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+        } while(!CPU_ISSET(cpu, &set));
+        pool->workers[i].cpu = cpu;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+ThreadPool *
+threadpool_create(int nthreads, int pin)
+{
+    ThreadPool *pool;
+    int i;
+
+    if(nthreads < 1) return NULL;
+
+    pool = calloc(1, sizeof(ThreadPool));
+    if(pool == NULL) return NULL;
+    pool->deques = calloc(nthreads+1, sizeof(TaskDeque));
+    pool->workers = calloc(nthreads, sizeof(Worker));
+    if(pool->deques == NULL || pool->workers == NULL ||
+       pthread_key_create(&pool->self, NULL)) {
+        free(pool->deques);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    if(pthread_key_create(&pool->timing, NULL)) {
+        pthread_key_delete(pool->self);
+        free(pool->deques);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->ndeques = nthreads+1;
+    for(i=0; i<pool->ndeques; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    for(i=0; i<nthreads; i++) {
+        pool->workers[i].cpu = -1;
+    }
+    if(pin && !assign_cpus(pool, nthreads)) {
+        pool->pinned = 1;
+    }
+
+    for(i=0; i<nthreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if(pthread_create(&pool->workers[i].thread, NULL, worker_thread,
+                          &pool->workers[i])) {
+            break;
+        }
+        pool->nthreads++;
+    }
+    if(pool->nthreads == 0) {
+        threadpool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void
+threadpool_destroy(ThreadPool *pool)
+{
+    int i;
+
+    if(pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for(i=0; i<pool->nthreads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for(i=0; i<pool->ndeques; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    pthread_key_delete(pool->timing);
+    pthread_key_delete(pool->self);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool);
+}
+
+int
+threadpool_threads(ThreadPool *pool)
+{
+    if(pool == NULL) return 0;
+    return pool->nthreads;
+}
+
+int
+threadpool_pinned(ThreadPool *pool)
+{
+    if(pool == NULL) return 0;
+    return pool->pinned;
+}
+
+void
+threadpool_new_group(ThreadPool *pool, ThreadGroup *group, int priority)
+{
+    group->id = 0;
+    group->priority = CLIP(priority, 0, THREAD_PRIORITIES-1);
+    group->cpu_time = NULL;
+    if(pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    group->id = pool->next_group++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void
+queue_task(ThreadPool *pool, ThreadTask *task, const ThreadGroup *group,
+           void (*func)(void *arg), void (*finish)(void *arg), void *arg)
+{
+    int self;
+
+    init_task(task, group, func, finish, arg);
+    if(pool == NULL) {
+        run_inline(task);
+        return;
+    }
+
+    self = worker_index(pool);
+    if(self < 0) self = pool->ndeques-1;
+    deque_push_bottom(&pool->deques[self], task);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued[task->priority]++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+threadpool_submit(ThreadPool *pool, ThreadTask *task, const ThreadGroup *group,
+                  void (*func)(void *arg), void *arg)
+{
+    queue_task(pool, task, group, func, NULL, arg);
+}
+
+void
+threadpool_run(ThreadPool *pool, ThreadTask *task, const ThreadGroup *group,
+               void (*func)(void *arg), void (*finish)(void *arg), void *arg)
+{
+    queue_task(pool, task, group, func, finish, arg);
+}
+
+void
+threadpool_wait(ThreadPool *pool, ThreadTask *task)
+{
+    ThreadTask *other;
+    int self, done;
+
+    if(pool == NULL) return;
+
+    self = worker_index(pool);
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        done = task->done;
+        pthread_mutex_unlock(&pool->lock);
+        if(done) break;
+
+        // help with queued work rather than blocking.  lower priority tasks
+        // are not taken, since they could delay the return to this one.
+        other = get_task(pool, self, task->priority);
+        if(other != NULL) {
+            run_task(pool, other);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while(!task->done && queued_tasks(pool, task->priority) == 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+#else /* HAVE_PTHREADS */
+
+ThreadPool *
+threadpool_create(int nthreads, int pin)
+{
+    return NULL;
+}
+
+void
+threadpool_destroy(ThreadPool *pool)
+{
+}
+
+int
+threadpool_threads(ThreadPool *pool)
+{
+    return 0;
+}
+
+int
+threadpool_pinned(ThreadPool *pool)
+{
+    return 0;
+}
+
+void
+threadpool_new_group(ThreadPool *pool, ThreadGroup *group, int priority)
+{
+    group->id = 0;
+    group->priority = CLIP(priority, 0, THREAD_PRIORITIES-1);
+    group->cpu_time = NULL;
+}
+
+void
+threadpool_submit(ThreadPool *pool, ThreadTask *task, const ThreadGroup *group,
+                  void (*func)(void *arg), void *arg)
+{
+    init_task(task, group, func, NULL, arg);
+    run_inline(task);
+}
+
+void
+threadpool_run(ThreadPool *pool, ThreadTask *task, const ThreadGroup *group,
+               void (*func)(void *arg), void (*finish)(void *arg), void *arg)
+{
+    init_task(task, group, func, finish, arg);
+    run_inline(task);
+}
+
+void
+threadpool_wait(ThreadPool *pool, ThreadTask *task)
+{
+}
+
+#endif /* HAVE_PTHREADS */
@@ -0,0 +1,122 @@
+/**
+ * Flake: FLAC audio encoder
+ * Copyright (c) 2006-2007 Justin Ruggles
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file thread.h
+ * Worker thread pool used for concurrent encoding
+ */
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "common.h"
+
+/* number of task priority classes; matches the FLAKE_PRIORITY_* values */
+#define THREAD_PRIORITIES 3
+
+typedef struct ThreadTask {
+    void (*func)(void *arg);
+    void (*finish)(void *arg);
+    void *arg;
+    unsigned int group;
+    int priority;
+    int64_t *cpu_time;
+    int done;
+    struct ThreadTask *prev, *next;
+} ThreadTask;
+
+/* the public FlakePool is the internal thread pool */
+typedef struct FlakePool ThreadPool;
+
+/**
+ * Starts a pool of worker threads.
+ * @param pin  if non-zero, pin each worker to one of the CPUs the process may
+ *             run on, in turn.  ignored where thread affinity is unsupported.
+ * @return NULL if threads are not supported or could not be created
+ */
+extern ThreadPool *threadpool_create(int nthreads, int pin);
+
+extern void threadpool_destroy(ThreadPool *pool);
+
+/**
+ * Returns the number of worker threads in the pool.
+ */
+extern int threadpool_threads(ThreadPool *pool);
+
+/**
+ * Returns non-zero if the workers are pinned to CPUs.
+ */
+extern int threadpool_pinned(ThreadPool *pool);
+
+/**
+ * Tasks of one stream.  Each stream using the pool takes a group, and every
+ * task it queues carries the group id and its priority class.
+ */
+typedef struct ThreadGroup {
+    unsigned int id;
+    int priority;
+    int64_t *cpu_time;  // if not NULL, CPU time used by the group's tasks is
+                        // added here, in nanoseconds
+} ThreadGroup;
+
+/**
+ * Initializes a new task group with a unique id and no CPU time counter.
+ * @param priority  priority class, 0 (lowest) to THREAD_PRIORITIES-1
+ */
+extern void threadpool_new_group(ThreadPool *pool, ThreadGroup *group,
+                                 int priority);
+
+/**
+ * Queues a task.  The task memory is owned by the caller and must stay valid
+ * until threadpool_wait() returns for it.  If pool is NULL, the task is run
+ * immediately on the calling thread.
+ *
+ * Tasks queued by a worker go to the bottom of its own deque and are taken
+ * back newest-first by that worker.  Tasks queued by other threads go to a
+ * shared deque.  Idle workers take tasks of the highest priority class
+ * first, and serve the groups within a class in rotation, so that streams
+ * sharing the pool progress at the same rate.
+ */
+extern void threadpool_submit(ThreadPool *pool, ThreadTask *task,
+                              const ThreadGroup *group,
+                              void (*func)(void *arg), void *arg);
+
+/**
+ * Queues a task which is never waited for.  When func returns, finish is
+ * called.  Once finish has been called, the pool does not touch the task
+ * again, so finish may hand the task memory back for reuse.
+ */
+extern void threadpool_run(ThreadPool *pool, ThreadTask *task,
+                           const ThreadGroup *group, void (*func)(void *arg),
+                           void (*finish)(void *arg), void *arg);
+
+/**
+ * Waits for a task to finish.  While waiting, the calling thread runs other
+ * queued tasks of the same or a higher priority, so tasks may safely submit
+ * and wait on sub-tasks.
+ */
+extern void threadpool_wait(ThreadPool *pool, ThreadTask *task);
+
+/**
+ * Returns the CPU time used by the calling thread, in nanoseconds, or 0 if
+ * this is not supported.
+ */
+extern int64_t thread_cpu_time(void);
+
+#endif /* THREAD_H */
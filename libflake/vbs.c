@@ -21,10 +21,29 @@
 
 #include "flake.h"
 #include "vbs.h"
+#include "bitio.h"
 #include "encode.h"
+#include "thread.h"
 
 #define SPLIT_THRESHOLD 100
 
+/* number of trial encodes done by split_frame_v2 (1+2+4+8) */
+#define VBS_TRIALS 15
+
+/**
+ * Private encoding context used for concurrent trial encodes.  Trials are
+ * assigned statically: context t encodes trials t, t+stride, t+2*stride...
+ */
+typedef struct VbsTrialJob {
+    FlakeContext s;
+    int16_t *samples;
+    int block_size;
+    int first;
+    int stride;
+    int (*fsizes)[8];
+    ThreadTask task;
+} VbsTrialJob;
+
 /**
  * Split single frame into smaller frames using predictability comparison.
  * This algorithm computes predictablity estimates for sections of the frame
@@ -82,6 +101,98 @@ split_frame_v1(int16_t *samples, int channels, int block_size,
     }
 }
 
+/**
+ * Number of private contexts to use for concurrent trial encodes.  Frame
+ * queue slots already keep the workers busy with whole frames, so a slot
+ * only gets its share of the pool, which keeps the total number of trial
+ * contexts below the number of workers.
+ */
+static int
+vbs_trial_contexts(FlacEncodeContext *ctx)
+{
+    return MIN(VBS_TRIALS, threadpool_threads(ctx->pool) /
+                           MAX(ctx->queue_slots, 1));
+}
+
+/**
+ * Allocate the private contexts used for concurrent trial encodes.  Each one
+ * is a copy of the encoding context with its own frame and bit writer, and
+ * its frame buffers only grow to the largest trial block it encodes.
+ */
+static int
+init_vbs_trials(FlakeContext *s)
+{
+    int i;
+    FlacEncodeContext *ctx, *tctx;
+    VbsTrialJob *job;
+
+    ctx = (FlacEncodeContext *) s->private_ctx;
+
+    ctx->vbs_trial_count = vbs_trial_contexts(ctx);
+    ctx->vbs_trials = calloc(ctx->vbs_trial_count, sizeof(VbsTrialJob));
+    if(ctx->vbs_trials == NULL) {
+        ctx->vbs_trial_count = 0;
+        return -1;
+    }
+
+    // on failure, free whatever was set up so the frame falls back to the
+    // serial path, and the next frame tries again from scratch
+    for(i=0; i<ctx->vbs_trial_count; i++) {
+        job = &ctx->vbs_trials[i];
+        job->s = *s;
+        job->s.header = NULL;
+        tctx = malloc(sizeof(FlacEncodeContext));
+        job->s.private_ctx = tctx;
+        if(tctx == NULL || copy_encode_context(tctx, ctx)) {
+            vbs_close(s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+vbs_close(FlakeContext *s)
+{
+    int i;
+    FlacEncodeContext *ctx, *tctx;
+
+    ctx = (FlacEncodeContext *) s->private_ctx;
+    if(ctx == NULL || ctx->vbs_trials == NULL) return;
+
+    for(i=0; i<ctx->vbs_trial_count; i++) {
+        tctx = (FlacEncodeContext *) ctx->vbs_trials[i].s.private_ctx;
+        if(tctx) {
+            free_context_buffers(tctx);
+            free(tctx);
+        }
+    }
+    free(ctx->vbs_trials);
+    ctx->vbs_trials = NULL;
+    ctx->vbs_trial_count = 0;
+}
+
+/**
+ * Trial k encodes sub-block j of level i, where level i splits the block
+ * into 2^i equal parts and k = 2^i - 1 + j.
+ */
+static void
+encode_trials_job(void *arg)
+{
+    VbsTrialJob *job = arg;
+    FlacEncodeContext *tctx = (FlacEncodeContext *) job->s.private_ctx;
+    int k, i, j, bs;
+
+    for(k=job->first; k<VBS_TRIALS; k+=job->stride) {
+        for(i=0; (2<<i) <= k+1; i++);
+        j = k + 1 - (1<<i);
+        bs = job->block_size >> i;
+        job->s.params.block_size = bs;
+        job->fsizes[i][j] = encode_frame(&job->s, NULL,
+                                         &job->samples[bs*j*tctx->channels]);
+    }
+}
+
 static void
 split_frame_v2(FlakeContext *s, int16_t *samples, int *frames, int sizes[8])
 {
@@ -91,16 +202,47 @@ split_frame_v2(FlakeContext *s, int16_t *samples, int *frames, int sizes[8])
     FlacEncodeContext *ctx = (FlacEncodeContext *) s->private_ctx;
     ch = ctx->channels;
 
-    // encode for each level to get sizes
-    for(i=0; i<4; i++) {
-        int levels, bs;
-        levels = (1<<i);
-        s->params.block_size /= levels;
-        bs = s->params.block_size;
-        for(j=0; j<levels; j++) {
-            fsizes[i][j] = encode_frame(s, NULL, &samples[bs*j*ch]);
+    if(ctx->pool != NULL && (ctx->params.thread_flags & FLAKE_THREAD_VBS) &&
+       vbs_trial_contexts(ctx) > 1 &&
+       (ctx->vbs_trials != NULL || !init_vbs_trials(s))) {
+        // the trial encodes are independent, so they are spread across the
+        // trial contexts.  all trials see the same frame number as the
+        // serial path, so the frame sizes are identical.
+        VbsTrialJob *job;
+        FlacEncodeContext *tctx;
+        for(i=0; i<ctx->vbs_trial_count; i++) {
+            job = &ctx->vbs_trials[i];
+            tctx = (FlacEncodeContext *) job->s.private_ctx;
+            tctx->params = ctx->params;
+            tctx->frame_count = ctx->frame_count;
+            job->s.params = s->params;
+            job->samples = samples;
+            job->block_size = s->params.block_size;
+            job->first = i;
+            job->stride = ctx->vbs_trial_count;
+            job->fsizes = fsizes;
+            if(i > 0) {
+                threadpool_submit(ctx->pool, &job->task, &ctx->pool_group,
+                                  encode_trials_job, job);
+            }
+        }
+        encode_trials_job(&ctx->vbs_trials[0]);
+        for(i=1; i<ctx->vbs_trial_count; i++) {
+            threadpool_wait(ctx->pool, &ctx->vbs_trials[i].task);
+        }
+    } else {
+        // encode for each level to get sizes
+        vbs_close(s);
+        for(i=0; i<4; i++) {
+            int levels, bs;
+            levels = (1<<i);
+            s->params.block_size /= levels;
+            bs = s->params.block_size;
+            for(j=0; j<levels; j++) {
+                fsizes[i][j] = encode_frame(s, NULL, &samples[bs*j*ch]);
+            }
+            s->params.block_size *= levels;
         }
-        s->params.block_size *= levels;
     }
 
     // initialize layout
@@ -24,4 +24,9 @@
 
 extern int encode_frame_vbs(FlakeContext *s, uint8_t *frame_buffer, int16_t *samples);
 
+/**
+ * Free the contexts used for concurrent trial encodes, if any.
+ */
+extern void vbs_close(FlakeContext *s);
+
 #endif /* VBS_H */
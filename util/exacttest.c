@@ -0,0 +1,672 @@
+/**
+ * Bit-exactness test for the threaded encoding paths
+ *
+ * Copyright (c) 2006 Justin Ruggles
+ *
+ * Each input file is encoded at every compression level, first serially with
+ * flake_encode_frame, one thread and the C kernels, then serially with each
+ * set of optimized kernels the CPU supports, and with each thread
+ * configuration.  Every frame must be byte-identical to the serial encode.
+ * The first frame that differs is reported along with the part of it (frame
+ * header, subframe or footer) containing the first differing bit.
+ */
+
+#include "common.h"
+
+#include <sys/time.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "flake.h"
+#include "wav.h"
+
+#define MAX_CONFIGS 64
+
+typedef struct TestConfig {
+    int serial;         // encode with flake_encode_frame
+    int threads;
+    int thread_flags;
+    int async;
+    int cpu_flags;
+} TestConfig;
+
+/** Frames from one encode of a file */
+typedef struct Encoding {
+    uint8_t *data;
+    uint32_t data_size;
+    int *frame_sizes;
+    int frame_count;
+    uint8_t md5[16];
+    double time;
+    int err;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+    int delivered;
+    uint32_t delivered_samples;     // sum of the block sizes delivered
+} Encoding;
+
+typedef struct TestInput {
+    char *fname;
+    int channels;
+    int sample_rate;
+    int bits_per_sample;
+    uint32_t samples;
+    int16_t *audio;
+} TestInput;
+
+static double
+now_seconds(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+add_frame(Encoding *e, const uint8_t *frame, int fs)
+{
+    uint8_t *data;
+
+    if((e->frame_count & 255) == 0) {
+        int *sizes = realloc(e->frame_sizes,
+                             (e->frame_count + 256) * sizeof(int));
+        if(sizes == NULL) return -1;
+        e->frame_sizes = sizes;
+    }
+    data = realloc(e->data, e->data_size + fs);
+    if(data == NULL) return -1;
+    e->data = data;
+    memcpy(&e->data[e->data_size], frame, fs);
+    e->data_size += fs;
+    e->frame_sizes[e->frame_count++] = fs;
+    return 0;
+}
+
+static void
+free_encoding(Encoding *e)
+{
+    free(e->data);
+    free(e->frame_sizes);
+    memset(e, 0, sizeof(Encoding));
+}
+
+/**
+ * Frame delivery for flake_encode_frame_async.  Callbacks for one context
+ * never overlap, but the main thread waits on the delivery count.  The
+ * reported block sizes are summed so that they can be checked against the
+ * input length.
+ */
+static void
+async_frame(void *opaque, const unsigned char *frame, int frame_size,
+            int block_size)
+{
+    Encoding *e = opaque;
+
+    if(frame == NULL || frame_size < 0 || add_frame(e, frame, frame_size)) {
+        e->err = 1;
+    }
+    e->delivered_samples += block_size;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&e->lock);
+    e->delivered++;
+    pthread_cond_signal(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+#else
+    e->delivered++;
+#endif
+}
+
+static int
+async_delivered(Encoding *e)
+{
+    int delivered;
+
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&e->lock);
+    delivered = e->delivered;
+    pthread_mutex_unlock(&e->lock);
+#else
+    delivered = e->delivered;
+#endif
+    return delivered;
+}
+
+static void
+async_wait(Encoding *e, int delivered)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&e->lock);
+    while(e->delivered == delivered) {
+        pthread_cond_wait(&e->cond, &e->lock);
+    }
+    pthread_mutex_unlock(&e->lock);
+#endif
+}
+
+/**
+ * Encodes the whole input.  Serial configurations encode frames one at a time
+ * with flake_encode_frame.
+ */
+static int
+encode_input(TestInput *in, int level, TestConfig *cfg, Encoding *e)
+{
+    FlakeContext s;
+    uint8_t *frame;
+    int16_t *samples;
+    uint32_t pos;
+    int bs, fs, err, submitted;
+    double start;
+
+    memset(e, 0, sizeof(Encoding));
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+#endif
+    memset(&s, 0, sizeof(FlakeContext));
+    s.channels = in->channels;
+    s.sample_rate = in->sample_rate;
+    s.bits_per_sample = in->bits_per_sample;
+    s.samples = in->samples;
+    s.params.compression = level;
+    if(flake_set_defaults(&s.params)) return -1;
+    s.params.threads = cfg->threads;
+    s.params.thread_flags = cfg->thread_flags;
+    s.params.cpu_flags = cfg->cpu_flags;
+    if(flake_validate_params(&s) < 0) return -1;
+
+    start = now_seconds();
+    if(flake_encode_init(&s) < 0) return -1;
+    frame = malloc(s.max_frame_size);
+    if(frame == NULL) {
+        flake_encode_close(&s);
+        return -1;
+    }
+
+    bs = s.params.block_size;
+    pos = 0;
+    submitted = 0;
+    err = 0;
+    while(!err) {
+        if(pos < in->samples) {
+            samples = &in->audio[pos * in->channels];
+            s.params.block_size = MIN(bs, in->samples - pos);
+            if(cfg->serial) {
+                fs = flake_encode_frame(&s, frame, samples);
+                if(fs < 0 || add_frame(e, frame, fs)) err = 1;
+                pos += s.params.block_size;
+                continue;
+            }
+            if(cfg->async) {
+                int delivered = async_delivered(e);
+                fs = flake_encode_frame_async(&s, samples, async_frame, e);
+                if(fs < 0) err = 1;
+                if(fs == 1) async_wait(e, delivered);
+                if(fs == 0) pos += s.params.block_size;
+                continue;
+            }
+            fs = flake_encode_submit(&s, samples);
+            if(fs < 0) err = 1;
+            if(fs == 0) {
+                pos += s.params.block_size;
+                submitted++;
+                continue;
+            }
+        }
+        if(cfg->serial || cfg->async || submitted == 0) break;
+        fs = flake_encode_collect(&s, frame, NULL);
+        if(fs < 0 || add_frame(e, frame, fs)) err = 1;
+        submitted--;
+    }
+    flake_encode_close(&s);
+    e->time = now_seconds() - start;
+    if(cfg->async && e->delivered_samples != in->samples) {
+        err = 1;
+    }
+    memcpy(e->md5, s.md5digest, 16);
+    free(frame);
+#ifdef HAVE_PTHREADS
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->cond);
+#endif
+
+    return (err || e->err) ? -1 : 0;
+}
+
+typedef struct BitReader {
+    const uint8_t *buf;
+    uint32_t size;      // in bits
+    uint32_t pos;
+} BitReader;
+
+static uint32_t
+get_bits(BitReader *br, int n)
+{
+    uint32_t v = 0;
+
+    while(n-- > 0) {
+        if(br->pos < br->size) {
+            v = (v << 1) | ((br->buf[br->pos >> 3] >> (7 - (br->pos & 7))) & 1);
+        } else {
+            v <<= 1;
+        }
+        br->pos++;
+    }
+    return v;
+}
+
+static void
+skip_utf8(BitReader *br)
+{
+    uint32_t v = get_bits(br, 8);
+
+    // each leading 1 bit after the first adds a byte
+    if(v & 0x80) {
+        for(v=(v << 1) & 0xFF; v & 0x80; v=(v << 1) & 0xFF) {
+            get_bits(br, 8);
+        }
+    }
+}
+
+static void
+skip_residual(BitReader *br, int block_size, int order)
+{
+    int method, porder, escape, param_bits, i, j, n;
+
+    method = get_bits(br, 2);
+    porder = get_bits(br, 4);
+    param_bits = method ? 5 : 4;
+    escape = (1 << param_bits) - 1;
+    for(i=0; i<(1 << porder) && br->pos < br->size; i++) {
+        int k = get_bits(br, param_bits);
+        n = (block_size >> porder) - (i ? 0 : order);
+        if(k == escape) {
+            k = get_bits(br, 5);
+            br->pos += n * k;
+            continue;
+        }
+        for(j=0; j<n && br->pos < br->size; j++) {
+            while(br->pos < br->size && !get_bits(br, 1));
+            br->pos += k;
+        }
+    }
+}
+
+/**
+ * Parses one frame starting at br->pos, and returns a description of the
+ * part of it containing bit, or NULL if bit lies beyond the frame.
+ */
+static const char *
+locate_bit(BitReader *br, int stream_bps, uint32_t bit, char *desc)
+{
+    static const int bps_codes[8] = { 0, 8, 12, 0, 16, 20, 24, 0 };
+    int bs_code, sr_code, ch_code, bps, block_size, channels, ch;
+
+    get_bits(br, 16);
+    bs_code = get_bits(br, 4);
+    sr_code = get_bits(br, 4);
+    ch_code = get_bits(br, 4);
+    bps = bps_codes[get_bits(br, 3)];
+    if(bps == 0) bps = stream_bps;
+    get_bits(br, 1);
+    skip_utf8(br);
+    if(bs_code == 1) {
+        block_size = 192;
+    } else if(bs_code <= 5) {
+        block_size = 576 << (bs_code - 2);
+    } else if(bs_code == 6) {
+        block_size = get_bits(br, 8) + 1;
+    } else if(bs_code == 7) {
+        block_size = get_bits(br, 16) + 1;
+    } else {
+        block_size = 256 << (bs_code - 8);
+    }
+    if(sr_code == 12) {
+        get_bits(br, 8);
+    } else if(sr_code == 13 || sr_code == 14) {
+        get_bits(br, 16);
+    }
+    get_bits(br, 8);
+    if(bit < br->pos) return "frame header";
+
+    channels = (ch_code < 8) ? ch_code + 1 : 2;
+    for(ch=0; ch<channels; ch++) {
+        int type, sbps, order;
+
+        sbps = bps;
+        if((ch_code == 8 || ch_code == 10) && ch == 1) sbps++;
+        if(ch_code == 9 && ch == 0) sbps++;
+        get_bits(br, 1);
+        type = get_bits(br, 6);
+        if(get_bits(br, 1)) {
+            while(br->pos < br->size && !get_bits(br, 1)) sbps--;
+            sbps--;
+        }
+        if(type == 0) {
+            sprintf(desc, "subframe %d (constant)", ch);
+            br->pos += sbps;
+        } else if(type == 1) {
+            sprintf(desc, "subframe %d (verbatim)", ch);
+            br->pos += sbps * block_size;
+        } else if(type & 0x20) {
+            int precision;
+            order = (type & 0x1F) + 1;
+            sprintf(desc, "subframe %d (lpc, order %d)", ch, order);
+            br->pos += sbps * order;
+            precision = get_bits(br, 4) + 1;
+            br->pos += 5 + precision * order;
+            skip_residual(br, block_size, order);
+        } else {
+            order = type & 7;
+            sprintf(desc, "subframe %d (fixed, order %d)", ch, order);
+            br->pos += sbps * order;
+            skip_residual(br, block_size, order);
+        }
+        if(bit < br->pos) return desc;
+    }
+
+    // byte alignment and CRC-16
+    br->pos = (br->pos + 7) & ~7;
+    br->pos += 16;
+    if(bit < br->pos) return "frame footer";
+    return NULL;
+}
+
+/**
+ * Describes where two encoded frames first differ.  One call to
+ * flake_encode_frame may return several FLAC frames when variable block
+ * sizes are used, so frames are walked until the differing bit is found.
+ */
+static void
+describe_difference(const uint8_t *ref, int ref_size, const uint8_t *out,
+                    int out_size, int bps, char *desc)
+{
+    BitReader br;
+    const char *part;
+    uint32_t bit;
+    int i, sub;
+
+    for(i=0; i<MIN(ref_size, out_size) && ref[i] == out[i]; i++);
+    if(i == MIN(ref_size, out_size)) {
+        sprintf(desc, "sizes %d and %d bytes, identical up to the shorter",
+                ref_size, out_size);
+        return;
+    }
+    bit = i * 8;
+    while(!((ref[i] ^ out[i]) & (0x80 >> (bit & 7)))) bit++;
+
+    br.buf = ref;
+    br.size = ref_size * 8;
+    br.pos = 0;
+    sub = 0;
+    part = NULL;
+    while(part == NULL && br.pos < br.size) {
+        char tmp[64];
+        part = locate_bit(&br, bps, bit, tmp);
+        if(part != NULL && sub > 0) {
+            sprintf(desc, "byte %d, frame %d of the block, %s", i, sub, part);
+            return;
+        }
+        if(part != NULL) {
+            sprintf(desc, "byte %d, %s", i, part);
+            return;
+        }
+        sub++;
+    }
+    sprintf(desc, "byte %d", i);
+}
+
+/**
+ * Compares an encode against the reference.
+ * @return 0 if identical
+ */
+static int
+compare_encoding(TestInput *in, Encoding *ref, Encoding *e, char *desc)
+{
+    uint32_t ro, eo;
+    int i;
+
+    ro = eo = 0;
+    for(i=0; i<MIN(ref->frame_count, e->frame_count); i++) {
+        int rs = ref->frame_sizes[i];
+        int es = e->frame_sizes[i];
+        if(rs != es || memcmp(&ref->data[ro], &e->data[eo], rs)) {
+            int n = sprintf(desc, "frame %d differs: ", i);
+            describe_difference(&ref->data[ro], rs, &e->data[eo], es,
+                                in->bits_per_sample, &desc[n]);
+            return 1;
+        }
+        ro += rs;
+        eo += es;
+    }
+    if(ref->frame_count != e->frame_count) {
+        sprintf(desc, "%d frames instead of %d", e->frame_count,
+                ref->frame_count);
+        return 1;
+    }
+    if(memcmp(ref->md5, e->md5, 16)) {
+        sprintf(desc, "MD5 checksum differs");
+        return 1;
+    }
+    return 0;
+}
+
+static int
+load_input(TestInput *in, char *fname)
+{
+    FILE *fp;
+    WavFile wf;
+    uint32_t n;
+    int nr;
+
+    memset(in, 0, sizeof(TestInput));
+    in->fname = fname;
+    fp = fopen(fname, "rb");
+    if(fp == NULL) {
+        fprintf(stderr, "cannot open %s\n", fname);
+        return -1;
+    }
+    if(wavfile_init(&wf, fp) || wf.samples == 0) {
+        fprintf(stderr, "invalid wav file: %s\n", fname);
+        fclose(fp);
+        return -1;
+    }
+    wf.read_format = WAV_SAMPLE_FMT_S16;
+    in->channels = wf.channels;
+    in->sample_rate = wf.sample_rate;
+    in->bits_per_sample = 16;
+    in->audio = malloc((size_t)wf.samples * wf.channels * sizeof(int16_t));
+    if(in->audio == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    n = 0;
+    while(n < wf.samples) {
+        nr = wavfile_read_samples(&wf, &in->audio[n * wf.channels],
+                                  MIN(4096, wf.samples - n));
+        if(nr <= 0) break;
+        n += nr;
+    }
+    in->samples = n;
+    fclose(fp);
+    return 0;
+}
+
+static void
+config_name(TestConfig *cfg, char *name)
+{
+    static const char *cpu_names[4] = { "sse4.1", "avx2", "avx512", "bmi2" };
+    int i, n;
+
+    if(cfg->serial) {
+        n = sprintf(name, "encode_frame ");
+    } else {
+        n = sprintf(name, "%s -n %d -x %d ", cfg->async ? "async" : "submit",
+                    cfg->threads, cfg->thread_flags);
+    }
+    if(cfg->cpu_flags == 0) {
+        sprintf(&name[n], "c");
+    } else if(cfg->cpu_flags == flake_get_cpu_flags()) {
+        sprintf(&name[n], "best");
+    } else {
+        for(i=0; i<4; i++) {
+            if(cfg->cpu_flags & (1 << i)) {
+                n += sprintf(&name[n], "%s%s", cpu_names[i],
+                             (cfg->cpu_flags >> (i+1)) ? "," : "");
+            }
+        }
+    }
+}
+
+static void
+set_config(TestConfig *cfg, int serial, int threads, int thread_flags,
+           int async, int cpu_flags)
+{
+    cfg->serial = serial;
+    cfg->threads = threads;
+    cfg->thread_flags = thread_flags;
+    cfg->async = async;
+    cfg->cpu_flags = cpu_flags;
+}
+
+/**
+ * The first configuration is the reference.  Kernel sets are tested one
+ * instruction set level at a time on a single thread, and thread
+ * configurations with the best kernels.
+ */
+static int
+make_configs(TestConfig *cfgs, int max_threads)
+{
+    static const int levels[3] = {
+        FLAKE_CPU_SSE41,
+        FLAKE_CPU_SSE41 | FLAKE_CPU_AVX2 | FLAKE_CPU_BMI2,
+        FLAKE_CPU_ALL
+    };
+    int i, n, count, cpu, last;
+
+    count = 0;
+    set_config(&cfgs[count++], 1, 1, 0, 0, 0);
+    cpu = flake_get_cpu_flags();
+    last = 0;
+    for(i=0; i<3; i++) {
+        if((levels[i] & cpu) != last) {
+            last = levels[i] & cpu;
+            set_config(&cfgs[count++], 1, 1, 0, 0, last);
+        }
+    }
+    for(n=1; n<=max_threads; n++) {
+        set_config(&cfgs[count++], 0, n, 0, 0, cpu);
+        set_config(&cfgs[count++], 0, n, FLAKE_THREAD_ALL, 0, cpu);
+    }
+    set_config(&cfgs[count++], 0, max_threads, FLAKE_THREAD_ALL, 1, cpu);
+    return count;
+}
+
+static int
+test_input(TestInput *in, int *levels, int level_count, TestConfig *cfgs,
+           int cfg_count)
+{
+    Encoding ref, e;
+    char name[64], desc[256];
+    int i, j, failures;
+
+    printf("%s: %d channels, %d Hz, %u samples\n", in->fname, in->channels,
+           in->sample_rate, in->samples);
+    printf("level  configuration                  frames      time  speedup  "
+           "result\n");
+    printf("-----  -----------------------------  ------  --------  -------  "
+           "------\n");
+    failures = 0;
+    for(i=0; i<level_count; i++) {
+        if(encode_input(in, levels[i], &cfgs[0], &ref)) {
+            printf("%5d  reference encode failed\n", levels[i]);
+            free_encoding(&ref);
+            failures++;
+            continue;
+        }
+        config_name(&cfgs[0], name);
+        printf("%5d  %-29s  %6d  %7.3fs  %6.2fx  reference\n", levels[i],
+               name, ref.frame_count, ref.time, 1.0);
+        for(j=1; j<cfg_count; j++) {
+            config_name(&cfgs[j], name);
+            if(encode_input(in, levels[i], &cfgs[j], &e)) {
+                printf("%5d  %-29s  encode failed\n", levels[i], name);
+                failures++;
+            } else {
+                int diff = compare_encoding(in, &ref, &e, desc);
+                printf("%5d  %-29s  %6d  %7.3fs  %6.2fx  %s\n", levels[i],
+                       name, e.frame_count, e.time,
+                       e.time > 0 ? ref.time / e.time : 0.0,
+                       diff ? desc : "identical");
+                failures += diff;
+            }
+            free_encoding(&e);
+        }
+        free_encoding(&ref);
+    }
+    printf("\n");
+    return failures;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "\nusage: exacttest [-n max_threads] [-l level] "
+                    "input.wav [input2.wav ...]\n"
+                    "  -n #  test 1 to # threads (default: 4)\n"
+                    "  -l #  test only this level (default: 0 to 12 and 99)\n"
+                    "\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    TestConfig cfgs[MAX_CONFIGS];
+    TestInput in;
+    int levels[14];
+    int level_count, cfg_count, max_threads, i, failures;
+
+    max_threads = 4;
+    level_count = 0;
+    for(i=1; i<argc-1 && argv[i][0] == '-'; i+=2) {
+        if(!strcmp(argv[i], "-n")) {
+            max_threads = atoi(argv[i+1]);
+            if(max_threads < 1 || max_threads > (MAX_CONFIGS-5)/2) usage();
+        } else if(!strcmp(argv[i], "-l")) {
+            levels[0] = atoi(argv[i+1]);
+            level_count = 1;
+        } else {
+            usage();
+        }
+    }
+    if(i >= argc) usage();
+    if(level_count == 0) {
+        for(level_count=0; level_count<13; level_count++) {
+            levels[level_count] = level_count;
+        }
+        levels[level_count++] = 99;
+    }
+    cfg_count = make_configs(cfgs, max_threads);
+
+    failures = 0;
+    for(; i<argc; i++) {
+        if(load_input(&in, argv[i])) {
+            failures++;
+            continue;
+        }
+        failures += test_input(&in, levels, level_count, cfgs, cfg_count);
+        free(in.audio);
+    }
+    if(failures) {
+        printf("%d encodes differ from the serial encode\n", failures);
+    } else {
+        printf("all encodes are identical to the serial encode\n");
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Stress test for concurrent encoding: encodes many inputs at once in a
+# single flake process and checks that every output is identical to a
+# serial, single-threaded encode of the same input.
+#
+# usage: thread-test.sh <count> "<flake options>" input.wav [input2.wav ...]
+# example: thread-test.sh 200 "-5 -n 4 -x 15" a.wav b.wav
+# requirements: flake, cmp, mktemp
+
+# change location of binaries if necessary
+flake="../flake/flake";
+
+count=$1;
+opts=$2;
+shift 2;
+if [ -z "$count" ] || [ $# -lt 1 ]; then
+    echo "usage: $0 <count> \"<flake options>\" input.wav [input2.wav ...]";
+    exit 1;
+fi
+
+tmp=$(mktemp -d) || exit 1;
+trap 'rm -rf "$tmp"' EXIT;
+
+# serial reference encodes, one per distinct input
+k=0;
+for f in "$@"; do
+    case "$f" in
+        /*) abs="$f" ;;
+        *)  abs="$(pwd)/$f" ;;
+    esac
+    ln -s "$abs" "$tmp/ref-$k.wav";
+    $flake -q $opts -n 1 -x 0 -j 1 "$tmp/ref-$k.wav" -o "$tmp/ref-$k.flac" || exit 1;
+    k=$((k+1));
+done
+inputs=$k;
+
+# inputs are cycled so that neighbouring encoders work on different audio
+i=0;
+while [ $i -lt $count ]; do
+    ln -s "$tmp/ref-$((i % inputs)).wav" "$tmp/job-$i.wav";
+    i=$((i+1));
+done
+
+echo "encoding $count files concurrently: flake $opts -j $count";
+$flake -q $opts -j $count $tmp/job-*.wav || exit 1;
+
+fail=0;
+i=0;
+while [ $i -lt $count ]; do
+    if ! cmp -s "$tmp/job-$i.flac" "$tmp/ref-$((i % inputs)).flac"; then
+        echo "mismatch: job $i (input $((i % inputs)))";
+        fail=$((fail+1));
+    fi
+    i=$((i+1));
+done
+
+echo "$((count-fail)) of $count outputs match the serial encode";
+[ $fail -eq 0 ];